@@ -0,0 +1,269 @@
+/*
+ *  The CRC of saveset blocks, for --verify-crc, and the XOR that
+ *  rebuilds a bad block from the rest of its redundancy group.  BACKUP
+ *  uses the AUTODIN-II polynomial, the same CRC-32 as Ethernet and zlib,
+ *  which the VAX computes with its CRC instruction.
+ *
+ *  Done eight bytes at a time with eight tables (slicing-by-8).  With
+ *  HAVE_X86_SIMD on a CPU that has PCLMULQDQ, the bulk of a block is
+ *  folded 64 bytes at a time with carry-less multiplies instead (after
+ *  Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ *  Instruction"); on 64-bit ARM the CRC32 instructions compute exactly
+ *  this CRC.  SSE4.2's crc32 instruction does not: it is for the
+ *  Castagnoli polynomial.  The XOR is done with SSE2 or AVX2.  As in
+ *  xlate.c, the choice is made on the first call or in crc_init.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "crc.h"
+
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define CRC_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#define CRC_ARM
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* The polynomial, bit reversed.  */
+#define CRC_POLY	0xedb88320
+
+static unsigned int crc_tab[8][256];
+
+static void crc_tables (void)
+{
+	unsigned int c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+		crc_tab[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			crc_tab[k][i] = (crc_tab[k - 1][i] >> 8)
+				^ crc_tab[0][crc_tab[k - 1][i] & 0xff];
+}
+
+static unsigned int crc_bytes (unsigned int crc, const unsigned char *p,
+			       size_t n)
+{
+	while (n-- > 0)
+		crc = (crc >> 8) ^ crc_tab[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+static unsigned int crc_slice8 (unsigned int crc, const unsigned char *p,
+				size_t n)
+{
+	unsigned int lo, hi;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16
+			    | (unsigned int)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+		crc = crc_tab[7][lo & 0xff] ^ crc_tab[6][(lo >> 8) & 0xff]
+			^ crc_tab[5][(lo >> 16) & 0xff] ^ crc_tab[4][lo >> 24]
+			^ crc_tab[3][hi & 0xff] ^ crc_tab[2][(hi >> 8) & 0xff]
+			^ crc_tab[1][(hi >> 16) & 0xff] ^ crc_tab[0][hi >> 24];
+	}
+	return crc_bytes (crc, p, n);
+}
+
+#ifdef CRC_X86
+
+/* x^(4*128+64) mod P, x^(4*128) mod P; the same for one 128 bit step;
+   x^64 mod P; and P with the quotient x^64 / P for the Barrett
+   reduction.  All of them bit reversed and shifted left by one.  */
+#define K1	0x154442bd4ULL
+#define K2	0x1c6e41596ULL
+#define K3	0x1751997d0ULL
+#define K4	0x0ccaa009eULL
+#define K5	0x163cd6124ULL
+#define KP	0x1db710641ULL
+#define KU	0x1f7011641ULL
+
+/* One step of folding: X times x^N (the two halves of K) plus DATA.  */
+#define FOLD(x, k, data) \
+	_mm_xor_si128 (_mm_xor_si128 (_mm_clmulepi64_si128 (x, k, 0x00), \
+				      _mm_clmulepi64_si128 (x, k, 0x11)), \
+		       data)
+
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int crc_pclmul (unsigned int crc, const unsigned char *p,
+				size_t n)
+{
+	__m128i x0, x1, x2, x3, k, mask;
+
+	if (n < 64)
+		return crc_slice8 (crc, p, n);
+	x0 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)p),
+			    _mm_cvtsi32_si128 (crc));
+	x1 = _mm_loadu_si128 ((const __m128i *)(p + 16));
+	x2 = _mm_loadu_si128 ((const __m128i *)(p + 32));
+	x3 = _mm_loadu_si128 ((const __m128i *)(p + 48));
+	p += 64;
+	n -= 64;
+
+	k = _mm_set_epi64x (K2, K1);
+	for (; n >= 64; n -= 64, p += 64) {
+		x0 = FOLD (x0, k, _mm_loadu_si128 ((const __m128i *)p));
+		x1 = FOLD (x1, k, _mm_loadu_si128 ((const __m128i *)(p + 16)));
+		x2 = FOLD (x2, k, _mm_loadu_si128 ((const __m128i *)(p + 32)));
+		x3 = FOLD (x3, k, _mm_loadu_si128 ((const __m128i *)(p + 48)));
+	}
+
+	/* Down to 128 bits, and on 16 bytes at a time.  */
+	k = _mm_set_epi64x (K4, K3);
+	x0 = FOLD (x0, k, x1);
+	x0 = FOLD (x0, k, x2);
+	x0 = FOLD (x0, k, x3);
+	for (; n >= 16; n -= 16, p += 16)
+		x0 = FOLD (x0, k, _mm_loadu_si128 ((const __m128i *)p));
+
+	/* 128 bits to 64, which also appends the 32 zero bits a CRC
+	   needs, then 64 to 32 with Barrett's reduction.  */
+	mask = _mm_set_epi32 (0, 0, 0, -1);
+	x0 = _mm_xor_si128 (_mm_clmulepi64_si128 (k, x0, 0x01),
+			    _mm_srli_si128 (x0, 8));
+	x1 = _mm_srli_si128 (x0, 4);
+	x0 = _mm_clmulepi64_si128 (_mm_and_si128 (x0, mask),
+				   _mm_set_epi64x (0, K5), 0x00);
+	x0 = _mm_xor_si128 (x0, x1);
+	k = _mm_set_epi64x (KU, KP);
+	x1 = x0;
+	x0 = _mm_clmulepi64_si128 (_mm_and_si128 (x0, mask), k, 0x10);
+	x0 = _mm_clmulepi64_si128 (_mm_and_si128 (x0, mask), k, 0x00);
+	x0 = _mm_xor_si128 (x0, x1);
+	crc = _mm_extract_epi32 (x0, 1);
+
+	return crc_slice8 (crc, p, n);
+}
+
+#endif /* CRC_X86 */
+
+static void xor_scalar (unsigned char *dst, const unsigned char *src,
+			size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] ^= src[i];
+}
+
+#ifdef CRC_X86
+
+__attribute__((target("sse2")))
+static void xor_sse2 (unsigned char *dst, const unsigned char *src,
+		      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		_mm_storeu_si128 ((__m128i *)(dst + i), _mm_xor_si128 (
+			_mm_loadu_si128 ((const __m128i *)(dst + i)),
+			_mm_loadu_si128 ((const __m128i *)(src + i))));
+	xor_scalar (dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2 (unsigned char *dst, const unsigned char *src,
+		      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+		_mm256_storeu_si256 ((__m256i *)(dst + i), _mm256_xor_si256 (
+			_mm256_loadu_si256 ((const __m256i *)(dst + i)),
+			_mm256_loadu_si256 ((const __m256i *)(src + i))));
+	xor_scalar (dst + i, src + i, n - i);
+}
+
+#endif /* CRC_X86 */
+
+#ifdef CRC_ARM
+
+__attribute__((target("+crc")))
+static unsigned int crc_arm (unsigned int crc, const unsigned char *p,
+			     size_t n)
+{
+	unsigned long long v;
+
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy (&v, p, 8);
+		crc = __crc32d (crc, v);
+	}
+	while (n-- > 0)
+		crc = __crc32b (crc, *p++);
+	return crc;
+}
+
+#endif /* CRC_ARM */
+
+static unsigned int crc_pick (unsigned int, const unsigned char *, size_t);
+static void xor_pick (unsigned char *, const unsigned char *, size_t);
+
+static unsigned int (*crc_fn) (unsigned int, const unsigned char *, size_t)
+	= crc_pick;
+static void (*xor_fn) (unsigned char *, const unsigned char *, size_t)
+	= xor_pick;
+
+/* Make the tables and choose the code for this CPU.  */
+void crc_init (void)
+{
+	if (crc_tab[0][1] == 0)
+		crc_tables ();
+	crc_fn = crc_slice8;
+	xor_fn = xor_scalar;
+#ifdef CRC_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("pclmul")
+	    && __builtin_cpu_supports ("sse4.1"))
+		crc_fn = crc_pclmul;
+	if (__builtin_cpu_supports ("avx2"))
+		xor_fn = xor_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+		xor_fn = xor_sse2;
+#endif
+#ifdef CRC_ARM
+	if (getauxval (AT_HWCAP) & HWCAP_CRC32)
+		crc_fn = crc_arm;
+#endif
+}
+
+static unsigned int crc_pick (unsigned int crc, const unsigned char *p,
+			      size_t n)
+{
+	crc_init ();
+	return crc_fn (crc, p, n);
+}
+
+static void xor_pick (unsigned char *dst, const unsigned char *src,
+		      size_t n)
+{
+	crc_init ();
+	xor_fn (dst, src, n);
+}
+
+/* Carry the CRC CRC on over the N bytes at P.  CRC is the bare
+   remainder: start with 0xffffffff and complement the result for the
+   usual CRC-32.  */
+unsigned int crc_update (unsigned int crc, const unsigned char *p, size_t n)
+{
+	return crc_fn (crc, p, n);
+}
+
+/* XOR the N bytes at SRC into those at DST.  */
+void block_xor (unsigned char *dst, const unsigned char *src, size_t n)
+{
+	xor_fn (dst, src, n);
+}
@@ -0,0 +1,5 @@
+/* CRC-32 (AUTODIN-II) and XOR of saveset blocks, see crc.c.  */
+
+void crc_init (void);
+unsigned int crc_update (unsigned int crc, const unsigned char *p, size_t n);
+void block_xor (unsigned char *dst, const unsigned char *src, size_t n);
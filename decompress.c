@@ -0,0 +1,881 @@
+/*
+ *  Compressed savesets.
+ *
+ *  A saveset compressed with gzip, xz or zstd is recognised by its magic
+ *  number and decompressed on the fly by worker threads, at the same
+ *  time as the main thread decodes the blocks.
+ *
+ *  The compressed input is divided into jobs, which the workers take in
+ *  order; the output of each job is queued on the job until decomp_read
+ *  (called from tapeio.c) gets to it.  For zstd a job is a run of whole
+ *  frames, whose boundaries the frame headers tell us.  A gzip file made
+ *  of several members (pigz -i, or plain concatenation) has no such
+ *  index, so a gzip job is a fixed stretch of the input in which the
+ *  worker looks for something which both looks like and inflates like
+ *  the start of a member.  That guess is checked when the reader gets
+ *  there: if the job before did not end exactly where this one starts,
+ *  the job is thrown away and redone from the right place.  xz input is
+ *  handed to liblzma's own threaded decoder.  Input we cannot map, such
+ *  as a pipe, is decompressed by a single worker, which still runs
+ *  alongside the decoding.
+ */
+
+#include "decompress.h"
+
+#ifdef HAVE_DECOMPRESS
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "vmsbackup.h"
+
+enum format { FMT_NONE, FMT_GZIP, FMT_XZ, FMT_ZSTD };
+static char *format_names[] = { "", "gzip", "xz", "zstd" };
+
+/* Output is queued in chunks of CHUNK_SIZE, at most JOB_CHUNKS of them
+   per job, so that a worker which gets ahead of the reader stops
+   rather than using up all the memory.  */
+#define CHUNK_SIZE	(256 * 1024)
+#define JOB_CHUNKS	32
+
+/* The amount of compressed input in a gzip job, and the least in a zstd
+   job (which is made up of whole frames).  */
+#define GZIP_SEGMENT	(32 * 1024 * 1024)
+#define ZSTD_SEGMENT	(8 * 1024 * 1024)
+
+/* How much of a candidate gzip member we inflate before we believe it
+   really is one.  */
+#define GZIP_PROBE	(64 * 1024)
+
+#define NOSTART		((size_t)-1)
+
+struct chunk {
+	struct chunk *next;
+	size_t	len;
+	unsigned char data[CHUNK_SIZE];
+};
+
+struct job {
+	unsigned long index;
+	/* The stretch of the input this job was given.  */
+	size_t	seg_start, seg_end;
+	/* Where its output really starts (NOSTART if there was nothing to
+	   start from in the stretch), and where the next job's output
+	   should start.  */
+	size_t	start, end;
+	int	start_known;
+	/* Set by the reader once START has been checked.  */
+	int	accepted;
+	/* Set by the reader to stop the worker.  If RESTART is also set,
+	   the worker does the job again from FORCED.  */
+	int	cancel, restart;
+	size_t	forced;
+	int	finished;	/* worker has produced everything */
+	int	done;		/* worker has let go of the job */
+	int	error;
+	struct chunk *head, *tail;
+	int	nchunks;
+	/* Read position within HEAD.  */
+	size_t	head_off;
+};
+
+static enum format dz_format;
+static int dz_fd;
+/* The compressed input, if we could map it, and its length (which is
+   unknown, and taken to be infinite, when we cannot).  */
+static const unsigned char *dz_in;
+static size_t dz_len;
+static int dz_mapped;
+/* Bytes the caller already read from DZ_FD to find the magic number.  */
+static unsigned char dz_head[16];
+static int dz_nhead;
+
+static pthread_mutex_t dz_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Workers wait on DZ_WORK, the reader on DZ_READ.  */
+static pthread_cond_t dz_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dz_read = PTHREAD_COND_INITIALIZER;
+static pthread_t *dz_threads;
+static int dz_nthreads;
+#ifdef HAVE_LZMA
+/* The threads asked for, which liblzma gets for itself while there is
+   only one worker.  */
+static int dz_xz_threads;
+#endif
+static int dz_shutdown;
+
+/* Jobs in hand live in a circular table of DZ_MAXJOBS entries.  DZ_CUR
+   is the one the reader is on, DZ_NEXT the next one to hand out, and
+   DZ_NEXT_IN where in the input it starts.  */
+static struct job *dz_jobs;
+static int dz_maxjobs;
+static unsigned long dz_cur, dz_next;
+static size_t dz_next_in;
+/* Where the next job's output has to start, according to the last job
+   the reader finished.  */
+static size_t dz_expect;
+static int dz_eof;
+
+#define JOB(i)	(&dz_jobs[(i) % dz_maxjobs])
+
+static enum format sniff (unsigned char *p, int n)
+{
+	if (n >= 3 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8)
+		return FMT_GZIP;
+	if (n >= 6 && memcmp (p, "\3757zXZ\0", 6) == 0)
+		return FMT_XZ;
+	if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f
+	    && p[3] == 0xfd)
+		return FMT_ZSTD;
+	return FMT_NONE;
+}
+
+static int format_supported (enum format fmt)
+{
+	switch (fmt) {
+#ifdef HAVE_ZLIB
+	case FMT_GZIP:
+		return 1;
+#endif
+#ifdef HAVE_LZMA
+	case FMT_XZ:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case FMT_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/* Queue LEN bytes of output on JOB.  Returns -1 if the reader has
+   cancelled the job, in which case the worker should give up on it.  */
+static int emit (struct job *job, const unsigned char *data, size_t len)
+{
+	struct chunk *c;
+	size_t n;
+
+	while (len > 0) {
+		pthread_mutex_lock (&dz_lock);
+		while (job->nchunks >= JOB_CHUNKS && !job->cancel)
+			pthread_cond_wait (&dz_work, &dz_lock);
+		if (job->cancel) {
+			pthread_mutex_unlock (&dz_lock);
+			return -1;
+		}
+		c = job->tail;
+		pthread_mutex_unlock (&dz_lock);
+
+		/* The reader never touches the tail chunk beyond its LEN,
+		   so we can fill it without holding the lock.  */
+		if (c == NULL || c->len == CHUNK_SIZE) {
+			c = malloc (sizeof (struct chunk));
+			if (c == NULL) {
+				fprintf (stderr, "out of memory\n");
+				exit (EXIT_FAILURE);
+			}
+			c->next = NULL;
+			c->len = 0;
+			n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+			memcpy (c->data, data, n);
+			c->len = n;
+			pthread_mutex_lock (&dz_lock);
+			if (job->tail == NULL)
+				job->head = c;
+			else
+				job->tail->next = c;
+			job->tail = c;
+			job->nchunks++;
+		} else {
+			n = CHUNK_SIZE - c->len;
+			if (n > len)
+				n = len;
+			memcpy (c->data + c->len, data, n);
+			pthread_mutex_lock (&dz_lock);
+			c->len += n;
+		}
+		pthread_cond_broadcast (&dz_read);
+		pthread_mutex_unlock (&dz_lock);
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int cancelled (struct job *job)
+{
+	int r;
+
+	pthread_mutex_lock (&dz_lock);
+	r = job->cancel;
+	pthread_mutex_unlock (&dz_lock);
+	return r;
+}
+
+static void publish_start (struct job *job, size_t start)
+{
+	pthread_mutex_lock (&dz_lock);
+	job->start = start;
+	job->start_known = 1;
+	pthread_cond_broadcast (&dz_read);
+	pthread_mutex_unlock (&dz_lock);
+}
+
+static void job_error (struct job *job, char *what)
+{
+	fprintf (stderr, "error decompressing %s saveset: %s\n",
+		 format_names[dz_format], what);
+	pthread_mutex_lock (&dz_lock);
+	job->error = 1;
+	pthread_mutex_unlock (&dz_lock);
+}
+
+/* Compressed input for a job which reads DZ_FD rather than the mapping.
+   Returns the number of bytes put in BUF, 0 at the end of the input.  */
+static ssize_t fd_input (unsigned char *buf, size_t size)
+{
+	ssize_t n;
+
+	if (dz_nhead > 0) {
+		memcpy (buf, dz_head, dz_nhead);
+		n = dz_nhead;
+		dz_nhead = 0;
+		return n;
+	}
+	do
+		n = read (dz_fd, buf, size);
+	while (n < 0 && errno == EINTR);
+	return n;
+}
+
+#define INBUF_SIZE	(1024 * 1024)
+
+#ifdef HAVE_ZLIB
+/* Does the input at P look like a gzip member header?  */
+static int gzip_header (const unsigned char *p, size_t n)
+{
+	return n >= 10 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8
+		&& (p[3] & 0xe0) == 0;
+}
+
+/* Make sure at least N bytes of input are available in INBUF after
+   *NEXT (there are *AVAIL now), moving them to the front of INBUF
+   first.  *BASE is the input offset of INBUF[0].  */
+static void fd_refill (unsigned char *inbuf, unsigned char **next,
+		       unsigned *avail, size_t *base, unsigned n)
+{
+	ssize_t got;
+
+	memmove (inbuf, *next, *avail);
+	*base += *next - inbuf;
+	*next = inbuf;
+	while (*avail < n) {
+		got = fd_input (inbuf + *avail, INBUF_SIZE - *avail);
+		if (got <= 0)
+			break;
+		*avail += got;
+	}
+}
+
+/* Inflate gzip members starting at input offset POS, until the input
+   ends or a member would start at or beyond the end of JOB's stretch.
+   If PROBE, we are not sure POS really is the start of a member; give
+   up quietly, returning 1, if it does not inflate.  */
+static int gzip_members (struct job *job, size_t pos, int probe,
+			 unsigned char *out, unsigned char *inbuf)
+{
+	z_stream z;
+	size_t produced = 0;
+	size_t base = 0;	/* input offset of INBUF[0] */
+	size_t at, left;
+	int ret, eof = 0;
+	ssize_t n;
+
+	memset (&z, 0, sizeof (z));
+	if (inflateInit2 (&z, 15 + 16) != Z_OK) {
+		job_error (job, "inflateInit2 failed");
+		return 0;
+	}
+	if (dz_mapped)
+		z.next_in = (unsigned char *)dz_in + pos;
+	for (;;) {
+		if (z.avail_in == 0 && !eof) {
+			if (dz_mapped) {
+				left = dz_len - (z.next_in - dz_in);
+				n = left > (1 << 30) ? (1 << 30) : left;
+			} else {
+				base += z.next_in ? z.next_in - inbuf : 0;
+				z.next_in = inbuf;
+				n = fd_input (inbuf, INBUF_SIZE);
+			}
+			if (n < 0) {
+				job_error (job, strerror (errno));
+				break;
+			}
+			z.avail_in = n;
+			if (n == 0)
+				eof = 1;
+		}
+		z.next_out = out;
+		z.avail_out = CHUNK_SIZE;
+		ret = inflate (&z, Z_NO_FLUSH);
+		at = dz_mapped ? z.next_in - dz_in : base + (z.next_in - inbuf);
+		if (ret == Z_BUF_ERROR && !eof)
+			ret = Z_OK;	/* it just wants more input */
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			if (probe) {
+				inflateEnd (&z);
+				return 1;
+			}
+			job_error (job, ret == Z_BUF_ERROR ? "unexpected end of file"
+				   : z.msg ? z.msg : "corrupt data");
+			break;
+		}
+		n = CHUNK_SIZE - z.avail_out;
+		produced += n;
+		if (probe && (produced >= GZIP_PROBE || at - pos >= GZIP_PROBE
+			      || ret == Z_STREAM_END)) {
+			/* It inflates; call it a member.  */
+			probe = 0;
+			publish_start (job, pos);
+		}
+		if (!probe && n > 0 && emit (job, out, n) < 0)
+			break;
+		if (ret != Z_STREAM_END)
+			continue;
+
+		/* End of a member.  Go on to the next one, unless it
+		   belongs to the next job.  Anything which is not another
+		   member is trailing garbage, which gzip ignores too.  */
+		if (dz_mapped)
+			left = dz_len - at;
+		else {
+			if (z.avail_in < 10)
+				fd_refill (inbuf, &z.next_in, &z.avail_in,
+					   &base, 10);
+			left = z.avail_in;
+		}
+		if (!gzip_header (z.next_in, left)) {
+			job->end = dz_len;
+			break;
+		}
+		if (at >= job->seg_end) {
+			job->end = at;
+			break;
+		}
+		inflateReset (&z);
+	}
+	inflateEnd (&z);
+	return 0;
+}
+
+static void gzip_job (struct job *job, unsigned char *out,
+		      unsigned char *inbuf)
+{
+	const unsigned char *p;
+	size_t pos;
+
+	job->end = dz_len;
+	if (!dz_mapped || job->forced != NOSTART) {
+		pos = dz_mapped ? job->forced : 0;
+		publish_start (job, pos);
+		gzip_members (job, pos, 0, out, inbuf);
+		return;
+	}
+	/* Look for the first member which starts in our stretch.  */
+	pos = job->seg_start;
+	while (pos < job->seg_end && !cancelled (job)) {
+		p = memchr (dz_in + pos, 0x1f, job->seg_end - pos);
+		if (p == NULL)
+			break;
+		pos = p - dz_in;
+		if (gzip_header (p, dz_len - pos)
+		    && gzip_members (job, pos, 1, out, inbuf) == 0)
+			return;
+		pos++;
+	}
+	publish_start (job, NOSTART);
+}
+#endif
+
+#ifdef HAVE_LZMA
+static void xz_job (struct job *job, unsigned char *out, unsigned char *inbuf)
+{
+	lzma_stream z = LZMA_STREAM_INIT;
+	lzma_action action = LZMA_RUN;
+	lzma_ret ret;
+	ssize_t n;
+#if LZMA_VERSION >= 50040002
+	lzma_mt mt;
+
+	memset (&mt, 0, sizeof (mt));
+	mt.flags = LZMA_CONCATENATED;
+	mt.threads = dz_xz_threads;
+	mt.memlimit_threading = lzma_physmem () / 4;
+	mt.memlimit_stop = UINT64_MAX;
+	ret = lzma_stream_decoder_mt (&z, &mt);
+#else
+	ret = lzma_stream_decoder (&z, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+	if (ret != LZMA_OK) {
+		job_error (job, "cannot initialize decoder");
+		return;
+	}
+	publish_start (job, 0);
+	job->end = dz_len;
+	if (dz_mapped) {
+		z.next_in = dz_in;
+		z.avail_in = dz_len;
+		action = LZMA_FINISH;
+	}
+	for (;;) {
+		if (z.avail_in == 0 && action == LZMA_RUN) {
+			n = fd_input (inbuf, INBUF_SIZE);
+			if (n < 0) {
+				job_error (job, strerror (errno));
+				break;
+			}
+			z.next_in = inbuf;
+			z.avail_in = n;
+			if (n == 0)
+				action = LZMA_FINISH;
+		}
+		z.next_out = out;
+		z.avail_out = CHUNK_SIZE;
+		ret = lzma_code (&z, action);
+		if (CHUNK_SIZE - z.avail_out > 0
+		    && emit (job, out, CHUNK_SIZE - z.avail_out) < 0)
+			break;
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret != LZMA_OK) {
+			job_error (job, ret == LZMA_DATA_ERROR
+				   ? "corrupt data" : "decoder failed");
+			break;
+		}
+	}
+	lzma_end (&z);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void zstd_job (struct job *job, unsigned char *out,
+		      unsigned char *inbuf, ZSTD_DCtx *dctx)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer o;
+	size_t ret = 0;
+	int full = 0;
+	ssize_t n;
+
+	ZSTD_DCtx_reset (dctx, ZSTD_reset_session_only);
+	publish_start (job, job->seg_start);
+	job->end = job->seg_end;
+	in.src = dz_mapped ? dz_in + job->seg_start : inbuf;
+	in.size = dz_mapped ? job->seg_end - job->seg_start : 0;
+	in.pos = 0;
+	for (;;) {
+		/* If the output filled up, the decoder may have more for
+		   us without needing any input.  */
+		if (in.pos == in.size && !full) {
+			if (dz_mapped)
+				break;
+			n = fd_input (inbuf, INBUF_SIZE);
+			if (n < 0) {
+				job_error (job, strerror (errno));
+				return;
+			}
+			if (n == 0)
+				break;
+			in.size = n;
+			in.pos = 0;
+		}
+		o.dst = out;
+		o.size = CHUNK_SIZE;
+		o.pos = 0;
+		ret = ZSTD_decompressStream (dctx, &o, &in);
+		if (ZSTD_isError (ret)) {
+			job_error (job, (char *)ZSTD_getErrorName (ret));
+			return;
+		}
+		if (o.pos > 0 && emit (job, out, o.pos) < 0)
+			return;
+		full = o.pos == o.size;
+	}
+	if (ret != 0)
+		job_error (job, "truncated frame");
+}
+#endif
+
+/* Work out the stretch of input for the next job.  Called with DZ_LOCK
+   held.  Returns 0 if there is no more input to hand out.  */
+static int next_job (struct job *job)
+{
+	size_t end;
+
+	if (dz_next_in >= dz_len)
+		return 0;
+	memset (job, 0, sizeof (*job));
+	job->index = dz_next;
+	job->seg_start = dz_next_in;
+	job->start = job->forced = NOSTART;
+	if (!dz_mapped || dz_format == FMT_XZ) {
+		/* One job does the lot.  */
+		end = dz_len;
+		job->accepted = 1;
+	} else if (dz_format == FMT_GZIP) {
+		end = dz_next_in + GZIP_SEGMENT;
+		if (end > dz_len)
+			end = dz_len;
+		if (job->seg_start == 0) {
+			job->forced = 0;
+			job->accepted = 1;
+		}
+	} else {
+#ifdef HAVE_ZSTD
+		size_t n;
+
+		end = dz_next_in;
+		while (end < dz_len && end - dz_next_in < ZSTD_SEGMENT) {
+			n = ZSTD_findFrameCompressedSize (dz_in + end,
+							  dz_len - end);
+			if (ZSTD_isError (n)) {
+				/* Let the decoder complain about it.  */
+				end = dz_len;
+				break;
+			}
+			end += n;
+		}
+#else
+		end = dz_len;
+#endif
+		job->accepted = 1;
+	}
+	job->seg_end = end;
+	dz_next_in = end;
+	dz_next++;
+	return 1;
+}
+
+static void *worker (void *arg)
+{
+	unsigned char *out, *inbuf = NULL;
+	struct job *job;
+	struct chunk *c;
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *dctx = ZSTD_createDCtx ();
+#endif
+
+	out = malloc (CHUNK_SIZE);
+	if (!dz_mapped)
+		inbuf = malloc (INBUF_SIZE);
+	if (out == NULL || (!dz_mapped && inbuf == NULL)) {
+		fprintf (stderr, "out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+	pthread_mutex_lock (&dz_lock);
+	for (;;) {
+		while (!dz_shutdown && dz_next_in < dz_len
+		       && dz_next >= dz_cur + dz_maxjobs)
+			pthread_cond_wait (&dz_work, &dz_lock);
+		if (dz_shutdown || !next_job (JOB (dz_next)))
+			break;
+		job = JOB (dz_next - 1);
+	  again:
+		pthread_mutex_unlock (&dz_lock);
+
+		switch (dz_format) {
+#ifdef HAVE_ZLIB
+		case FMT_GZIP:
+			gzip_job (job, out, inbuf);
+			break;
+#endif
+#ifdef HAVE_LZMA
+		case FMT_XZ:
+			xz_job (job, out, inbuf);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case FMT_ZSTD:
+			zstd_job (job, out, inbuf, dctx);
+			break;
+#endif
+		default:
+			break;
+		}
+
+		pthread_mutex_lock (&dz_lock);
+		if (!job->start_known) {
+			job->start = NOSTART;
+			job->start_known = 1;
+		}
+		job->finished = 1;
+		pthread_cond_broadcast (&dz_read);
+		/* A gzip job may yet have to be done again from elsewhere;
+		   hang on to it until the reader has had a look.  */
+		while (!job->accepted && !job->cancel)
+			pthread_cond_wait (&dz_work, &dz_lock);
+		if (job->cancel && job->restart) {
+			while ((c = job->head) != NULL) {
+				job->head = c->next;
+				free (c);
+			}
+			job->tail = NULL;
+			job->nchunks = 0;
+			job->head_off = 0;
+			job->start_known = job->finished = 0;
+			job->cancel = job->restart = 0;
+			job->accepted = 1;
+			goto again;
+		}
+		job->done = 1;
+		pthread_cond_broadcast (&dz_read);
+	}
+	pthread_mutex_unlock (&dz_lock);
+#ifdef HAVE_ZSTD
+	ZSTD_freeDCtx (dctx);
+#endif
+	free (out);
+	free (inbuf);
+	return NULL;
+}
+
+/* Find out whether the saveset on FD is compressed, and if it is (and
+   we can decompress it), start the workers and return nonzero; from
+   then on decomp_read gives the decompressed saveset.  HEAD holds the
+   first NHEAD bytes of the input, which the caller has already read if
+   FD is a stream; otherwise NHEAD is 0 and we look for ourselves.  */
+int decomp_open (int fd, unsigned char *head, int nhead)
+{
+	unsigned char magic[8];
+#ifdef HAVE_MMAP
+	struct stat st;
+#endif
+	int i, n;
+
+	if (nhead > 0) {
+		n = nhead < (int)sizeof (magic) ? nhead : (int)sizeof (magic);
+		memcpy (magic, head, n);
+	} else
+		n = pread (fd, magic, sizeof (magic), 0);
+	dz_format = sniff (magic, n);
+	if (dz_format == FMT_NONE)
+		return 0;
+	if (!format_supported (dz_format)) {
+		fprintf (stderr, "saveset is compressed with %s, which this vmsbackup cannot decompress\n",
+			 format_names[dz_format]);
+		exit (EXIT_FAILURE);
+	}
+
+	dz_fd = fd;
+	dz_nhead = nhead;
+	memcpy (dz_head, head, nhead);
+	dz_mapped = 0;
+	dz_len = (size_t)-1;
+#ifdef HAVE_MMAP
+	if (nhead == 0 && fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+	    && st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size) {
+		void *p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p != MAP_FAILED) {
+			dz_in = p;
+			dz_len = st.st_size;
+			dz_mapped = 1;
+			madvise (p, dz_len, MADV_SEQUENTIAL);
+		}
+	}
+#endif
+
+	dz_nthreads = nthreads;
+	if (dz_nthreads < 1)
+		dz_nthreads = 1;
+	dz_maxjobs = 2 * dz_nthreads + 2;
+#ifdef HAVE_LZMA
+	dz_xz_threads = dz_nthreads;
+#endif
+	dz_jobs = calloc (dz_maxjobs, sizeof (struct job));
+	dz_threads = calloc (dz_nthreads, sizeof (pthread_t));
+	if (dz_jobs == NULL || dz_threads == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+	dz_cur = dz_next = 0;
+	dz_next_in = 0;
+	dz_expect = 0;
+	dz_eof = 0;
+	dz_shutdown = 0;
+#ifdef DEBUG
+	if (debugflag)
+		printf ("saveset is compressed with %s%s, %d thread%s\n",
+			format_names[dz_format], dz_mapped ? "" : " (stream)",
+			dz_nthreads, dz_nthreads == 1 ? "" : "s");
+#endif
+	/* Several workers only help if the input can be divided up; xz
+	   does its own threading.  */
+	if (!dz_mapped || dz_format == FMT_XZ)
+		dz_nthreads = 1;
+	for (i = 0; i < dz_nthreads; i++)
+		if (pthread_create (&dz_threads[i], NULL, worker, NULL) != 0) {
+			fprintf (stderr, "cannot start decompression thread\n");
+			exit (EXIT_FAILURE);
+		}
+	return 1;
+}
+
+/* Called with DZ_LOCK held; works out whether the job the reader is on
+   really carries on from the one before it, and deals with it if not.
+   Returns the job to read from, or NULL at the end of the input.  */
+static struct job *current_job (void)
+{
+	struct job *job;
+	struct chunk *c;
+
+	for (;;) {
+		if (dz_expect >= dz_len)
+			return NULL;
+		while (dz_cur >= dz_next && dz_next_in < dz_len)
+			pthread_cond_wait (&dz_read, &dz_lock);
+		if (dz_cur >= dz_next)
+			return NULL;
+		job = JOB (dz_cur);
+		while (!job->start_known)
+			pthread_cond_wait (&dz_read, &dz_lock);
+		if (job->accepted || job->start == dz_expect)
+			break;
+		if (dz_expect < job->seg_end) {
+			/* Wrong guess; do it again from where the job
+			   before really ended.  */
+			job->forced = dz_expect;
+			job->restart = 1;
+		}
+		/* Otherwise the job before went right through this one's
+		   stretch, so there is nothing here for us.  */
+		job->cancel = 1;
+		pthread_cond_broadcast (&dz_work);
+		if (job->restart) {
+			while (job->restart || !job->start_known)
+				pthread_cond_wait (&dz_read, &dz_lock);
+			continue;
+		}
+		while (!job->done)
+			pthread_cond_wait (&dz_read, &dz_lock);
+		while ((c = job->head) != NULL) {
+			job->head = c->next;
+			free (c);
+		}
+		dz_cur++;
+		pthread_cond_broadcast (&dz_work);
+	}
+	if (!job->accepted) {
+		job->accepted = 1;
+		pthread_cond_broadcast (&dz_work);
+	}
+	return job;
+}
+
+/* Read up to SIZE bytes of decompressed saveset into BUF.  Returns the
+   number of bytes read, 0 at the end, or -1 on error.  */
+int decomp_read (unsigned char *buf, int size)
+{
+	struct job *job;
+	struct chunk *c;
+	int n;
+
+	pthread_mutex_lock (&dz_lock);
+	for (;;) {
+		if (dz_eof || (job = current_job ()) == NULL) {
+			dz_eof = 1;
+			pthread_mutex_unlock (&dz_lock);
+			return 0;
+		}
+		c = job->head;
+		if (c != NULL && job->head_off < c->len) {
+			n = c->len - job->head_off;
+			if (n > size)
+				n = size;
+			pthread_mutex_unlock (&dz_lock);
+			/* The worker only ever adds beyond C->LEN.  */
+			memcpy (buf, c->data + job->head_off, n);
+			pthread_mutex_lock (&dz_lock);
+			job->head_off += n;
+			pthread_mutex_unlock (&dz_lock);
+			return n;
+		}
+		if (c != NULL && (c->next != NULL || c->len == CHUNK_SIZE
+				  || job->finished)) {
+			/* Used up, and the worker won't add to it.  */
+			job->head = c->next;
+			if (job->head == NULL)
+				job->tail = NULL;
+			job->nchunks--;
+			job->head_off = 0;
+			free (c);
+			pthread_cond_broadcast (&dz_work);
+			continue;
+		}
+		if (job->finished && c == NULL) {
+			if (job->error) {
+				pthread_mutex_unlock (&dz_lock);
+				errno = EIO;
+				return -1;
+			}
+			while (!job->done)
+				pthread_cond_wait (&dz_read, &dz_lock);
+			dz_expect = job->end;
+			dz_cur++;
+			pthread_cond_broadcast (&dz_work);
+			continue;
+		}
+		pthread_cond_wait (&dz_read, &dz_lock);
+	}
+}
+
+void decomp_close (void)
+{
+	struct chunk *c;
+	int i;
+
+	if (dz_format == FMT_NONE)
+		return;
+	pthread_mutex_lock (&dz_lock);
+	dz_shutdown = 1;
+	for (i = 0; i < dz_maxjobs; i++)
+		dz_jobs[i].cancel = 1;
+	pthread_cond_broadcast (&dz_work);
+	pthread_mutex_unlock (&dz_lock);
+	for (i = 0; i < dz_nthreads; i++)
+		pthread_join (dz_threads[i], NULL);
+	for (i = 0; i < dz_maxjobs; i++)
+		while ((c = dz_jobs[i].head) != NULL) {
+			dz_jobs[i].head = c->next;
+			free (c);
+		}
+	free (dz_jobs);
+	free (dz_threads);
+#ifdef HAVE_MMAP
+	if (dz_mapped)
+		munmap ((void *)dz_in, dz_len);
+#endif
+	dz_format = FMT_NONE;
+}
+
+#endif /* HAVE_DECOMPRESS */
@@ -0,0 +1,10 @@
+/* Compressed savesets, see decompress.c.  */
+
+#if defined(HAVE_PTHREAD) \
+    && (defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD))
+#define HAVE_DECOMPRESS 1
+
+int decomp_open (int fd, unsigned char *head, int nhead);
+int decomp_read (unsigned char *buf, int size);
+void decomp_close (void);
+#endif
@@ -4,10 +4,13 @@ char *version = "VMSBACKUP4.3";
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <errno.h>
 #include "vmsbackup.h"
 #include "sysdep.h"
+#include "xlate.h"
 
 #ifdef HAVE_STARLET
 #include "descrip.h"
@@ -15,7 +18,7 @@ char *version = "VMSBACKUP4.3";
 
 static void usage (char *progname)
 {
-	fprintf (stderr, "Usage: %s -{tx}[cdevwFVBD][-b blocksize][-s setnumber][-f tapefile] [ name ... ]\n",
+	fprintf (stderr, "Usage: %s -{tx}[cdevwFVBD][-b blocksize][-j threads][-s setnumber][-f tapefile] [ name ... ]\n",
 		 progname);
 #ifdef HAVE_GETOPTLONG
 	fprintf(stderr, "\nWith long versions of the above:\n"
@@ -23,7 +26,8 @@ static void usage (char *progname)
 	"\tc\tcomplete\t\tRetain complete filename\n"
 	"\td\tdirectory\tCreate subdirectories\n"
 	"\te\textension\tExtract all files\n"
-	"\tf\tfile\t\tRead from file\n"
+	"\tf\tfile\t\tRead from file (- for standard input)\n"
+	"\tj\tthreads\t\tNumber of threads for decompression and decoding\n"
 	"\ts\tsaveset\t\tRead saveset number\n"
 	"\tt\tlist\t\tList files in saveset\n"
 	"\tv\tverbose\t\tList files as they are processed\n"
@@ -34,6 +38,25 @@ static void usage (char *progname)
 	"\tB\tbinary\t\tExtract as binary files\n"
 	"\tD\tdebug\t\tPrint debug information (if compiled with DEBUG)\n"
 	"\t?\thelp\t\tDisplay this help message\n");
+	fprintf(stderr, "\nLong options only:\n");
+#ifdef HAVE_PTHREAD
+	fprintf(stderr,
+	"\t\tbuffer=SIZE\tRead ahead into a buffer of SIZE bytes (K, M, G)\n"
+	"\t\tbuffer-lock\tLock the read-ahead buffer in memory\n"
+	"\t\tbuffer-huge\tUse huge pages for the read-ahead buffer\n");
+#endif
+#ifdef HAVE_IO_URING
+	fprintf(stderr,
+	"\t\tio-uring[=N]\tKeep N reads of a disk saveset in flight\n"
+	"\t\turing-files[=N]\tWrite up to N small files at once\n");
+#endif
+	fprintf(stderr,
+	"\t\timage-to=FILE\tCopy the tape to the SIMH tape image FILE\n"
+	"\t\tto-utf8[=SET]\tConvert text from SET (mcs, latin1) to UTF-8\n"
+	"\t\tverify-crc\tCheck the CRC and header checksum of each block\n"
+	"\t\tsalvage\t\tCarry on past damaged blocks\n"
+	"\t\twrite-buffer=SIZE\tWrite extracted files SIZE bytes at a time\n"
+	"\t\tsparse\t\tLeave holes where extracted files are all zeros\n");
 #endif
 }
 
@@ -41,6 +64,19 @@ extern int optind;
 extern char *optarg;
 
 #ifdef HAVE_GETOPTLONG
+/* Values for the options which only have a long name.  */
+#define OPT_BUFFER	256
+#define OPT_BUFFER_LOCK	257
+#define OPT_BUFFER_HUGE	258
+#define OPT_IO_URING	259
+#define OPT_IMAGE_TO	260
+#define OPT_TO_UTF8	261
+#define OPT_VERIFY_CRC	262
+#define OPT_SALVAGE	263
+#define OPT_WRITE_BUFFER	264
+#define OPT_SPARSE	265
+#define OPT_URING_FILES	266
+
 static const struct option OptionListLong[] =
 {
 	{"blocksize", 1, 0, 'b'},
@@ -48,6 +84,7 @@ static const struct option OptionListLong[] =
 	{"directory", 0, 0, 'd'},
 	{"extension", 0, 0, 'e'},
 	{"file", 1, 0, 'f'},
+	{"threads", 1, 0, 'j'},
 	{"saveset", 1, 0, 's'},
 	{"list", 0, 0, 't'},
 	{"verbose", 0, 0, 'v'},
@@ -58,8 +95,56 @@ static const struct option OptionListLong[] =
 	{"binary", 0, 0, 'B'},
 	{"debug", 0, 0, 'D'},
 	{"help", 0, 0, '?'},
+#ifdef HAVE_PTHREAD
+	{"buffer", 1, 0, OPT_BUFFER},
+	{"buffer-lock", 0, 0, OPT_BUFFER_LOCK},
+	{"buffer-huge", 0, 0, OPT_BUFFER_HUGE},
+#endif
+#ifdef HAVE_IO_URING
+	{"io-uring", 2, 0, OPT_IO_URING},
+	{"uring-files", 2, 0, OPT_URING_FILES},
+#endif
+	{"image-to", 1, 0, OPT_IMAGE_TO},
+	{"to-utf8", 2, 0, OPT_TO_UTF8},
+	{"verify-crc", 0, 0, OPT_VERIFY_CRC},
+	{"salvage", 0, 0, OPT_SALVAGE},
+	{"write-buffer", 1, 0, OPT_WRITE_BUFFER},
+	{"sparse", 0, 0, OPT_SPARSE},
 	{0, 0, 0, 0}
 };
+
+/* Parse a size given on the command line, such as "512K" or "1G".  */
+static long parse_size (char *arg)
+{
+	char *end;
+	long n;
+	int shift;
+
+	errno = 0;
+	n = strtol (arg, &end, 0);
+	shift = 0;
+	switch (*end) {
+	case 'k': case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		end++;
+		break;
+	}
+	if (*end != '\0' || n < 0 || errno == ERANGE
+	    || n > LONG_MAX >> shift) {
+		fprintf (stderr, "invalid size: %s\n", arg);
+		exit (1);
+	}
+	n <<= shift;
+	return n;
+}
 #endif
 
 int main (int argc, char *argv[])
@@ -85,10 +170,10 @@ int main (int argc, char *argv[])
 	tapefile = NULL;
 
 #ifdef HAVE_GETOPTLONG
-	while((c=getopt_long(argc,argv,"b:cdef:s:tvwxFVBD",
+	while((c=getopt_long(argc,argv,"b:cdef:j:s:tvwxFVBD",
 		OptionListLong, &OptionIndex)) != EOF)
 #else
-	while((c=getopt(argc,argv,"b:cdef:s:tvwxFVBD")) != EOF)
+	while((c=getopt(argc,argv,"b:cdef:j:s:tvwxFVBD")) != EOF)
 #endif
 		switch(c){
 		case 'b':
@@ -106,6 +191,9 @@ int main (int argc, char *argv[])
 		case 'f':
 			tapefile = optarg;
 			break;
+		case 'j':
+			sscanf (optarg, "%d", &nthreads);
+			break;
 		case 's':
 			sflag++;
 			sscanf(optarg,"%d",&selset);
@@ -147,16 +235,74 @@ int main (int argc, char *argv[])
 			/* Debugging code on */
 			debugflag = 1;
 			break;
+#ifdef HAVE_GETOPTLONG
+		case OPT_BUFFER:
+			tape_buffer = parse_size (optarg);
+			break;
+		case OPT_BUFFER_LOCK:
+			flag_buffer_lock = 1;
+			break;
+		case OPT_BUFFER_HUGE:
+			flag_buffer_huge = 1;
+			break;
+		case OPT_IO_URING:
+			uring_depth = 32;
+			if (optarg != NULL)
+				sscanf (optarg, "%d", &uring_depth);
+			if (uring_depth < 1)
+				uring_depth = 1;
+			break;
+		case OPT_IMAGE_TO:
+			image_file = optarg;
+			break;
+		case OPT_TO_UTF8:
+			if (optarg == NULL || strcmp (optarg, "mcs") == 0)
+				to_utf8 = XLATE_MCS;
+			else if (strcmp (optarg, "latin1") == 0)
+				to_utf8 = XLATE_LATIN1;
+			else {
+				fprintf (stderr, "unknown character set: %s\n",
+					 optarg);
+				exit (1);
+			}
+			break;
+		case OPT_VERIFY_CRC:
+			verify_crc = 1;
+			break;
+		case OPT_SALVAGE:
+			salvage = 1;
+			break;
+		case OPT_WRITE_BUFFER:
+			write_buffer = parse_size (optarg);
+			break;
+		case OPT_SPARSE:
+			sparse = 1;
+			break;
+#ifdef HAVE_IO_URING
+		case OPT_URING_FILES:
+			uring_files = 32;
+			if (optarg != NULL)
+				sscanf (optarg, "%d", &uring_files);
+			if (uring_files < 1)
+				uring_files = 1;
+			break;
+#endif
+#endif
 		case '?':
 			usage(progname);
 			exit(1);
 			break;
 		};
 	goptind = optind;
-	if(!tflag && !xflag) {
+	if(!tflag && !xflag && image_file == NULL) {
 		usage(progname);
 		exit(1);
 	}
+	/* The answers to -w would be read from the save set.  */
+	if (wflag && tapefile != NULL && strcmp (tapefile, "-") == 0) {
+		fprintf (stderr, "%s: -w cannot be used with -f -\n", progname);
+		exit (1);
+	}
 	vmsbackup ();
     return 0;
 }
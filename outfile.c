@@ -0,0 +1,834 @@
+/*
+ *  Writing the files being extracted.  stdio would write them in pieces
+ *  of BUFSIZ bytes and leave the file system to guess how big each file
+ *  is going to be; we know that from its attributes.  So the file is
+ *  given all of its space at the start (with HAVE_FALLOCATE), and its
+ *  data goes out from one big page aligned buffer (--write-buffer, 1M
+ *  by default), every write but the last a whole buffer at an offset
+ *  that is a multiple of its size.  Since what we write is often not
+ *  exactly as long as the file was on VMS (records turned into lines,
+ *  text into UTF-8, files cut short), the file is cut back to what was
+ *  written when it is closed.
+ *
+ *  With --sparse, each aligned piece of OUT_HOLE bytes that is all zeros
+ *  is not written but seeked over, which leaves a hole in the file; the
+ *  file is then not preallocated, as that would allocate the holes too.
+ *  The test for zeros uses SSE2 or AVX2 with HAVE_X86_SIMD, chosen on
+ *  the first call as in xlate.c.
+ *
+ *  Data that is to go into the file exactly as it is in a saveset on
+ *  disk can instead be copied by the kernel, with copy_file_range or,
+ *  to a pipe, splice (HAVE_COPY_FILE_RANGE), so that it never passes
+ *  through our memory.  Where the kernel will not do that for a file,
+ *  such as between two file systems, it is written as usual.
+ *
+ *  Small files can be created and written through io_uring instead,
+ *  many at a time; see below.  The directories they go into are made
+ *  here too, and remembered.
+ *
+ *  Only one file is open at a time, and they all share the buffer.  As
+ *  with stdio, one that is still open when the program exits is closed
+ *  then.
+ */
+
+#if defined(HAVE_FALLOCATE) || defined(HAVE_COPY_FILE_RANGE)
+/* for fallocate, copy_file_range and splice */
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_UNIXIO_H
+#include <unixio.h>
+#ifndef __vax
+/* The help claims that mkdir is declared in stdlib.h but it doesn't
+   seem to be true.  AXP/VMS 6.2, DECC ?.?.  On the other hand, VAX/VMS 6.2
+   seems to declare it in a way which conflicts with this definition.
+   This is starting to sound like a bad dream.  */
+int mkdir (char *path, int mode);
+#endif
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#include "vmsbackup.h"
+#include "outfile.h"
+
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define OUT_X86
+#include <immintrin.h>
+#endif
+
+#define OUT_DEFAULT	(1L << 20)
+#define OUT_ALIGN	4096
+/* The pieces that can become holes: the block size of most file
+   systems.  */
+#define OUT_HOLE	4096
+
+static unsigned char *out_buf;
+static size_t out_size;
+/* The file that is open, if any.  */
+static OUTFILE *out_cur;
+
+/* Whether the N bytes at P are all zero.  */
+static int zero_scalar (const unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (p[i] != 0)
+			return 0;
+	return 1;
+}
+
+#ifdef OUT_X86
+
+/* Both OR together 64 bytes at a time, and look at the result.  */
+__attribute__((target("sse2")))
+static int zero_sse2 (const unsigned char *p, size_t n)
+{
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		v = _mm_or_si128 (
+			_mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(p + i)),
+				      _mm_loadu_si128 ((const __m128i *)(p + i + 16))),
+			_mm_or_si128 (_mm_loadu_si128 ((const __m128i *)(p + i + 32)),
+				      _mm_loadu_si128 ((const __m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, _mm_setzero_si128 ()))
+		    != 0xffff)
+			return 0;
+	}
+	return zero_scalar (p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int zero_avx2 (const unsigned char *p, size_t n)
+{
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		v = _mm256_or_si256 (
+			_mm256_loadu_si256 ((const __m256i *)(p + i)),
+			_mm256_loadu_si256 ((const __m256i *)(p + i + 32)));
+		if (!_mm256_testz_si256 (v, v))
+			return 0;
+	}
+	return zero_scalar (p + i, n - i);
+}
+
+#endif /* OUT_X86 */
+
+static int zero_pick (const unsigned char *, size_t);
+
+static int (*zero_fn) (const unsigned char *, size_t) = zero_pick;
+
+static int zero_pick (const unsigned char *p, size_t n)
+{
+	zero_fn = zero_scalar;
+#ifdef OUT_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		zero_fn = zero_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+		zero_fn = zero_sse2;
+#endif
+	return zero_fn (p, n);
+}
+
+/*
+ *  The directories files are extracted into (-d).  Every one that has
+ *  been made, or found to be there, is remembered in a hash table, so
+ *  that each is made once rather than every component of the path being
+ *  made again for every file.  With HAVE_OPENAT the last DIR_FDS of them
+ *  are also kept open, and directories are made and files created
+ *  relative to those, which spares the kernel walking the whole path
+ *  each time.  Savesets hold a directory's files together, so that few
+ *  are needed.
+ */
+
+#define DIR_FDS		64
+
+struct dir {
+	char		*name;
+	/* The directory open, or -1; -2 if it cannot be opened.  */
+	int		fd;
+};
+
+static struct dir **dir_tab;
+/* The size of dir_tab, a power of 2, and how many are in it.  */
+static size_t dir_size, dir_count;
+#ifdef HAVE_OPENAT
+/* The ones that are open, the oldest at dir_next once it is full.  */
+static struct dir *dir_open[DIR_FDS];
+static int dir_next;
+#endif
+
+/* FNV-1a.  */
+static size_t dir_hash (const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/* Where the LEN bytes at NAME are or would go in the table.  */
+static struct dir **dir_slot (const char *name, size_t len)
+{
+	size_t i;
+
+	for (i = dir_hash (name, len) & (dir_size - 1); dir_tab[i] != NULL;
+	     i = (i + 1) & (dir_size - 1))
+		if (strncmp (dir_tab[i]->name, name, len) == 0
+		    && dir_tab[i]->name[len] == '\0')
+			break;
+	return &dir_tab[i];
+}
+
+static struct dir *dir_find (const char *name, size_t len)
+{
+	return dir_tab != NULL ? *dir_slot (name, len) : NULL;
+}
+
+/* Remember the directory NAME, which is there.  */
+static struct dir *dir_add (const char *name)
+{
+	struct dir **old, **t, *d;
+	size_t i, n;
+
+	if (2 * (dir_count + 1) > dir_size) {
+		n = dir_size > 0 ? 2 * dir_size : 256;
+		t = calloc (n, sizeof (*t));
+		if (t == NULL)
+			return NULL;
+		old = dir_tab;
+		dir_tab = t;
+		dir_size = n;
+		for (i = 0; i < n / 2; i++)
+			if (old != NULL && old[i] != NULL)
+				*dir_slot (old[i]->name, strlen (old[i]->name))
+					= old[i];
+		free (old);
+	}
+	d = malloc (sizeof (*d) + strlen (name) + 1);
+	if (d == NULL)
+		return NULL;
+	d->name = (char *)(d + 1);
+	strcpy (d->name, name);
+	d->fd = -1;
+	*dir_slot (name, strlen (name)) = d;
+	dir_count++;
+	return d;
+}
+
+#ifdef HAVE_OPENAT
+/* Open D, LEAF in the directory AT, in place of the oldest one that is
+   open.  */
+static void dir_hold (struct dir *d, int at, const char *leaf)
+{
+	struct dir *old = dir_open[dir_next];
+
+	d->fd = openat (at, leaf, O_RDONLY | O_DIRECTORY);
+	if (d->fd < 0) {
+		d->fd = -2;
+		return;
+	}
+	if (old != NULL) {
+		close (old->fd);
+		old->fd = -1;
+	}
+	dir_open[dir_next] = d;
+	dir_next = (dir_next + 1) % DIR_FDS;
+}
+
+/* The directory to create the file NAME in, and its name there in
+   *LEAF: the directory it is in if that is known and can be kept open,
+   else the current one.  */
+static int dir_of (const char *name, const char **leaf)
+{
+	const char *p = strrchr (name, '/');
+	struct dir *d;
+
+	if (p != NULL && (d = dir_find (name, p - name)) != NULL) {
+		if (d->fd == -1)
+			dir_hold (d, AT_FDCWD, d->name);
+		if (d->fd >= 0) {
+			*leaf = p + 1;
+			return d->fd;
+		}
+	}
+	*leaf = name;
+	return AT_FDCWD;
+}
+#endif
+
+/* Make the directory PATH and those it is in, as mkdir -p would.  PATH
+   is changed on the way but left as it was.  Returns -1 with errno set
+   if it cannot be done.  */
+int out_mkdir (char *path)
+{
+	char *p;
+#ifdef HAVE_OPENAT
+	const char *leaf;
+	struct dir *d;
+	int at;
+#endif
+
+	if (*path == '\0' || dir_find (path, strlen (path)) != NULL)
+		return 0;
+	p = strrchr (path, '/');
+	if (p != NULL) {
+		*p = '\0';
+		if (out_mkdir (path) < 0) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+#ifdef HAVE_OPENAT
+	at = dir_of (path, &leaf);
+	if (mkdirat (at, leaf, 0777) < 0 && errno != EEXIST)
+		return -1;
+	d = dir_add (path);
+	if (d != NULL)
+		dir_hold (d, at, leaf);
+#else
+	if (mkdir (path, 0777) < 0 && errno != EEXIST)
+		return -1;
+	dir_add (path);
+#endif
+	return 0;
+}
+
+/* Open the file O is for, to hold SIZE bytes, more or less.  Returns
+   -1 with errno set if it cannot be done.  */
+static int out_start (OUTFILE *o, long size)
+{
+	struct stat st;
+#ifdef HAVE_OPENAT
+	const char *leaf;
+	int at;
+
+	at = dir_of (o->name, &leaf);
+	o->fd = openat (at, leaf, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#else
+	o->fd = open (o->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+	if (o->fd < 0)
+		return -1;
+	o->ptr = out_buf;
+	o->end = out_buf + out_size;
+	if (fstat (o->fd, &st) < 0)
+		st.st_mode = 0;
+	if (S_ISFIFO (st.st_mode))
+		o->pipe = 1;
+	else if (S_ISREG (st.st_mode)) {
+		if (sparse)
+			o->sparse = o->setsize = 1;
+#ifdef HAVE_FALLOCATE
+		/* Not posix_fallocate: where the file system cannot do it,
+		   glibc would write a byte into every block of the file
+		   instead.  */
+		else if (size > 0 && fallocate (o->fd, 0, 0, size) == 0)
+			o->setsize = 1;
+#endif
+	}
+	return 0;
+}
+
+/* Write the N bytes at P to the file.  After an error nothing more is
+   written; out_close reports it.  */
+static void out_raw (OUTFILE *o, const unsigned char *p, size_t n)
+{
+	long k;
+
+	while (n > 0 && o->err == 0) {
+		k = write (o->fd, p, n);
+		if (k < 0) {
+			if (errno != EINTR)
+				o->err = errno;
+			continue;
+		}
+		p += k;
+		n -= k;
+		o->pos += k;
+	}
+}
+
+/* out_raw, but leaving holes for the pieces that are all zero.  */
+static void out_sparse (OUTFILE *o, const unsigned char *p, size_t n)
+{
+	size_t k, run;
+
+	while (n > 0 && o->err == 0) {
+		/* Whole pieces of zeros are skipped.  */
+		k = OUT_HOLE - o->pos % OUT_HOLE;
+		if (k == OUT_HOLE && n >= OUT_HOLE && zero_fn (p, OUT_HOLE)) {
+			o->pos += OUT_HOLE;
+			o->seek = 1;
+			p += OUT_HOLE;
+			n -= OUT_HOLE;
+			continue;
+		}
+		/* The rest is written up to the next such piece.  */
+		for (run = k < n ? k : n; n - run >= OUT_HOLE; run += OUT_HOLE)
+			if (zero_fn (p + run, OUT_HOLE))
+				break;
+		if (run < n && n - run < OUT_HOLE)
+			run = n;
+		if (o->seek && lseek (o->fd, o->pos, SEEK_SET) < 0) {
+			o->err = errno;
+			break;
+		}
+		o->seek = 0;
+		out_raw (o, p, run);
+		p += run;
+		n -= run;
+	}
+}
+
+static void out_put (OUTFILE *o, const unsigned char *p, size_t n)
+{
+	if (o->sparse)
+		out_sparse (o, p, n);
+	else
+		out_raw (o, p, n);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ *  Small files with --uring-files.  Opening, writing and closing a file
+ *  of a few hundred bytes is three system calls that each wait on the
+ *  file system.  Instead, a file whose attributes say it fits in
+ *  OUT_SMALL bytes is collected in a slot of its own, and when it is
+ *  closed an openat, a write and a close for it are queued, linked so
+ *  that they are done in that order, with the file opened into the
+ *  slot's entry of a table of direct descriptors (Linux 5.15 or later).
+ *  They go to the kernel OU_BATCH files at a time, and we only wait for
+ *  them when we need a slot.  A file that turns out to be bigger is
+ *  opened and written as usual.  Errors are reported as the files are
+ *  finished.
+ */
+
+#define OUT_SMALL	65536
+#define OU_BATCH	8
+
+/* What each operation of a file is, in the low bits of user_data.  */
+enum { OU_OPEN, OU_WRITE, OU_CLOSE };
+
+struct slot {
+	unsigned char	*buf;
+	size_t		len;
+	/* Operations still to complete; -1 while the file is being
+	   collected, 0 if the slot is free.  */
+	int		pending;
+	int		err;
+	/* Nonzero if the kernel could not open into the table.  */
+	int		old;
+	char		*name;
+};
+
+static struct uring ou;
+/* 1 once the ring is set up, -1 if it cannot be.  */
+static int ou_state;
+static struct slot *ou_slot;
+/* Files queued and not yet submitted.  */
+static int ou_unsent;
+
+static int ou_init (void)
+{
+	unsigned char *mem;
+	int k;
+
+	if (ou_state != 0)
+		return ou_state > 0 ? 0 : -1;
+	ou_state = -1;
+	ou_slot = calloc (uring_files, sizeof (*ou_slot));
+	mem = malloc ((size_t)uring_files * OUT_SMALL);
+	if (ou_slot == NULL || mem == NULL)
+		return -1;
+	for (k = 0; k < uring_files; k++)
+		ou_slot[k].buf = mem + (size_t)k * OUT_SMALL;
+	if (uring_init (&ou, 4 * uring_files) < 0
+	    || uring_register_files (&ou, uring_files) < 0) {
+#ifdef DEBUG
+		if (debugflag)
+			perror ("io_uring");
+#endif
+		return -1;
+	}
+	ou_state = 1;
+	return 0;
+}
+
+/* The file in slot S is done with.  */
+static void ou_done (struct slot *s)
+{
+	OUTFILE t;
+
+	if (s->old) {
+		/* Write it the ordinary way after all, and the rest too.  */
+		ou_state = -1;
+		t.fd = open (s->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		t.err = t.fd < 0 ? errno : 0;
+		t.pos = 0;
+		out_raw (&t, s->buf, s->len);
+		if (t.fd >= 0 && close (t.fd) < 0 && t.err == 0)
+			t.err = errno;
+		s->err = t.err;
+		s->old = 0;
+	}
+	if (s->err != 0)
+		fprintf (stderr, "%s: %s\n", s->name, strerror (s->err));
+	free (s->name);
+	s->name = NULL;
+	s->pending = 0;
+}
+
+static void ou_reap (void)
+{
+	struct io_uring_cqe *cqe;
+	struct slot *s;
+	int op, res;
+
+	while ((cqe = uring_peek (&ou)) != NULL) {
+		s = &ou_slot[cqe->user_data >> 2];
+		op = cqe->user_data & 3;
+		res = cqe->res;
+		uring_seen (&ou);
+		/* After a failure the rest of the file is cancelled.  */
+		if (op == OU_OPEN && res == -EINVAL)
+			s->old = 1;
+		else if (s->err == 0 && res < 0 && res != -ECANCELED)
+			s->err = -res;
+		else if (s->err == 0 && op == OU_WRITE && (size_t)res < s->len)
+			s->err = ENOSPC;
+		if (--s->pending == 0)
+			ou_done (s);
+	}
+}
+
+/* Send what is queued, and if WAIT, wait for at least one file to
+   finish.  */
+static void ou_submit (int wait)
+{
+	if (uring_submit (&ou, wait) < 0) {
+		perror ("io_uring_enter");
+		exit (EXIT_FAILURE);
+	}
+	ou_unsent = 0;
+	ou_reap ();
+}
+
+/* Whether a file named NAME is on its way.  */
+static int ou_busy (const char *name)
+{
+	int k;
+
+	for (k = 0; k < uring_files; k++)
+		if (ou_slot[k].pending > 0 && strcmp (ou_slot[k].name, name) == 0)
+			return 1;
+	return 0;
+}
+
+/* Wait until no file named NAME is on its way, so that a file that is
+   extracted twice ends up as the later one.  */
+static void ou_wait_name (const char *name)
+{
+	if (ou_slot == NULL)
+		return;
+	if (ou_unsent > 0)
+		ou_submit (0);
+	while (ou_busy (name))
+		ou_submit (1);
+}
+
+/* Get O a slot to be collected in.  Returns -1 if it cannot have
+   one.  */
+static int ou_get (OUTFILE *o)
+{
+	int k;
+
+	if (ou_init () < 0)
+		return -1;
+	for (;;) {
+		ou_reap ();
+		for (k = 0; k < uring_files; k++)
+			if (ou_slot[k].pending == 0)
+				break;
+		if (k < uring_files && !ou_busy (o->name))
+			break;
+		ou_submit (1);
+		if (ou_state < 0)
+			return -1;
+	}
+	ou_slot[k].pending = -1;
+	o->slot = k;
+	o->ptr = ou_slot[k].buf;
+	o->end = ou_slot[k].buf + OUT_SMALL;
+	return 0;
+}
+
+/* O does not fit in its slot after all.  */
+static void ou_spill (OUTFILE *o)
+{
+	struct slot *s = &ou_slot[o->slot];
+	size_t n = o->ptr - s->buf;
+
+	o->slot = -1;
+	s->pending = 0;
+	if (out_start (o, 0) < 0) {
+		o->err = errno;
+		o->ptr = out_buf;
+		o->end = out_buf + out_size;
+		return;
+	}
+	out_raw (o, s->buf, n);
+}
+
+/* Queue the openat, write and close for the file collected in O's
+   slot.  */
+static void ou_queue (OUTFILE *o)
+{
+	struct io_uring_sqe *sqe[3];
+	struct slot *s = &ou_slot[o->slot];
+	int k = o->slot;
+
+	s->len = o->ptr - s->buf;
+	s->err = s->old = 0;
+	s->name = malloc (strlen (o->name) + 1);
+	if (s->name == NULL) {
+		fprintf (stderr, "out of memory\n");
+		exit (EXIT_FAILURE);
+	}
+	strcpy (s->name, o->name);
+	/* There is always room, with four entries for each slot.  */
+	sqe[0] = uring_sqe (&ou);
+	sqe[1] = uring_sqe (&ou);
+	sqe[2] = uring_sqe (&ou);
+
+	sqe[0]->opcode = IORING_OP_OPENAT;
+	sqe[0]->flags = IOSQE_IO_LINK;
+	sqe[0]->fd = AT_FDCWD;
+	sqe[0]->addr = (unsigned long)s->name;
+	sqe[0]->len = 0666;
+	sqe[0]->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	sqe[0]->file_index = k + 1;
+	sqe[0]->user_data = k << 2 | OU_OPEN;
+
+	/* The close goes on even if the write fails.  */
+	sqe[1]->opcode = IORING_OP_WRITE;
+	sqe[1]->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe[1]->fd = k;
+	sqe[1]->addr = (unsigned long)s->buf;
+	sqe[1]->len = s->len;
+	sqe[1]->off = 0;
+	sqe[1]->user_data = k << 2 | OU_WRITE;
+
+	sqe[2]->opcode = IORING_OP_CLOSE;
+	sqe[2]->file_index = k + 1;
+	sqe[2]->user_data = k << 2 | OU_CLOSE;
+
+	s->pending = 3;
+	o->slot = -1;
+	if (++ou_unsent >= OU_BATCH)
+		ou_submit (0);
+}
+
+/* Wait for every file on its way.  */
+static void ou_drain (void)
+{
+	int k;
+
+	if (ou_slot == NULL)
+		return;
+	for (k = 0; k < uring_files; k++)
+		while (ou_slot[k].pending > 0)
+			ou_submit (1);
+}
+#endif /* HAVE_IO_URING */
+
+static void out_exit (void)
+{
+	if (out_cur != NULL)
+		out_close (out_cur);
+#ifdef HAVE_IO_URING
+	ou_drain ();
+#endif
+}
+
+static int out_buffer (void)
+{
+	unsigned char *mem;
+
+	if (out_buf != NULL)
+		return 0;
+	out_size = write_buffer > 0 ? write_buffer : OUT_DEFAULT;
+	/* Whole pieces, so that what is written stays aligned.  */
+	out_size = (out_size + OUT_HOLE - 1) / OUT_HOLE * OUT_HOLE;
+	mem = malloc (out_size + OUT_ALIGN - 1);
+	if (mem == NULL)
+		return -1;
+	out_buf = mem + (-(size_t)mem & (OUT_ALIGN - 1));
+	atexit (out_exit);
+	return 0;
+}
+
+/* Create the file NAME to hold SIZE bytes, more or less.  Returns NULL
+   with errno set if it cannot be done.  */
+OUTFILE *out_open (const char *name, long size)
+{
+	OUTFILE *o;
+
+	if (out_buffer () < 0)
+		return NULL;
+	o = malloc (sizeof (*o) + strlen (name) + 1);
+	if (o == NULL)
+		return NULL;
+	o->fd = -1;
+	o->pos = 0;
+	o->err = 0;
+	o->setsize = o->sparse = o->seek = 0;
+	o->pipe = o->nocopy = 0;
+	o->slot = -1;
+	o->name = (char *)(o + 1);
+	strcpy (o->name, name);
+#ifdef HAVE_IO_URING
+	if (uring_files > 0 && !sparse && size <= OUT_SMALL
+	    && ou_get (o) == 0) {
+		out_cur = o;
+		return o;
+	}
+	ou_wait_name (name);
+#endif
+	if (out_start (o, size) < 0) {
+		free (o);
+		return NULL;
+	}
+	out_cur = o;
+	return o;
+}
+
+static void out_flush (OUTFILE *o)
+{
+#ifdef HAVE_IO_URING
+	if (o->slot >= 0) {
+		ou_spill (o);
+		return;
+	}
+#endif
+	out_put (o, out_buf, o->ptr - out_buf);
+	o->ptr = out_buf;
+}
+
+void out_write (OUTFILE *o, const void *p, size_t n)
+{
+	const unsigned char *q = p;
+	size_t k;
+
+	while (n > 0) {
+		if (o->ptr == out_buf && n >= out_size) {
+			/* Whole buffers' worth need not be copied.  */
+			k = n - n % out_size;
+			out_put (o, q, k);
+		} else {
+			k = o->end - o->ptr;
+			if (k > n)
+				k = n;
+			memcpy (o->ptr, q, k);
+			o->ptr += k;
+			if (o->ptr == o->end)
+				out_flush (o);
+		}
+		q += k;
+		n -= k;
+	}
+}
+
+/* Copy N bytes from offset OFF of the file FROM to the file.  Returns
+   how many were copied, which is less than N (often 0) if the kernel
+   would not copy the rest, which then has to be written with
+   out_write.  */
+size_t out_copy (OUTFILE *o, int from, long off, size_t n)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t in = off;
+	size_t done;
+	ssize_t k;
+
+	/* Holes are made from the data itself, and a small file is
+	   better off in its slot.  */
+	if (o->nocopy || o->sparse || o->slot >= 0 || o->err != 0)
+		return 0;
+	out_flush (o);
+	for (done = 0; done < n; done += k) {
+		if (o->pipe)
+			k = splice (from, &in, o->fd, NULL, n - done, 0);
+		else
+			k = copy_file_range (from, &in, o->fd, NULL, n - done, 0);
+		if (k < 0 && errno == EINTR) {
+			k = 0;
+			continue;
+		}
+		if (k <= 0) {
+			/* EXDEV, EINVAL, ENOSYS and the like.  A real error
+			   will come up again when the rest is written.  */
+			o->nocopy = 1;
+			break;
+		}
+		o->pos += k;
+	}
+	return done;
+#else
+	return 0;
+#endif
+}
+
+/* out_putc when the buffer is full.  */
+void out_putc1 (int c, OUTFILE *o)
+{
+	out_flush (o);
+	*o->ptr++ = c;
+}
+
+/* Write what is left, cut the file back to it and close it.  Returns 0,
+   or -1 if anything went wrong, which has been reported.  A small file
+   with --uring-files is only queued here; see above.  */
+int out_close (OUTFILE *o)
+{
+	int err;
+
+#ifdef HAVE_IO_URING
+	if (o->slot >= 0) {
+		ou_queue (o);
+		free (o);
+		out_cur = NULL;
+		return 0;
+	}
+#endif
+	out_flush (o);
+	if (o->setsize && ftruncate (o->fd, o->pos) < 0 && o->err == 0)
+		o->err = errno;
+	if (o->fd >= 0 && close (o->fd) < 0 && o->err == 0)
+		o->err = errno;
+	err = o->err;
+	if (err != 0)
+		fprintf (stderr, "%s: %s\n", o->name, strerror (err));
+	free (o);
+	out_cur = NULL;
+	return err != 0 ? -1 : 0;
+}
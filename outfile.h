@@ -0,0 +1,37 @@
+/* Writing the files being extracted, see outfile.c.  */
+
+struct outfile {
+	int		fd;
+	/* Where the next byte goes in the buffer, and its end.  */
+	unsigned char	*ptr, *end;
+	/* How long the file is so far, not counting the buffer.  */
+	long		pos;
+	/* errno of the first write that failed, or 0.  */
+	int		err;
+	/* Nonzero if the file has to be set to the length written when it
+	   is closed: space was allocated ahead, or it may end in a hole.  */
+	int		setsize;
+	/* Nonzero to leave holes (--sparse), and if the file offset has
+	   fallen behind POS because of one.  */
+	int		sparse, seek;
+	/* Nonzero if it is a pipe, and if the kernel would not copy to it
+	   (see out_copy).  */
+	int		pipe, nocopy;
+	/* With --uring-files, the slot a small file is being collected in
+	   before it goes to the kernel in one piece, or -1.  */
+	int		slot;
+	char		*name;
+};
+
+typedef struct outfile OUTFILE;
+
+/* Like putc, one byte into the buffer.  */
+#define out_putc(c, o) \
+	((o)->ptr < (o)->end ? (void)(*(o)->ptr++ = (c)) : out_putc1 ((c), (o)))
+
+OUTFILE *out_open (const char *name, long size);
+void out_write (OUTFILE *o, const void *p, size_t n);
+void out_putc1 (int c, OUTFILE *o);
+size_t out_copy (OUTFILE *o, int from, long off, size_t n);
+int out_close (OUTFILE *o);
+int out_mkdir (char *path);
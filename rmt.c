@@ -0,0 +1,403 @@
+/*
+ *  Remote tape access.  A tape named [user@]system:/dev/??? is read
+ *  through an rmt(8) server on SYSTEM, started with rsh (or whatever the
+ *  RSH environment variable names; RMT overrides the path of the server,
+ *  /etc/rmt).  The older form system[.user]:/dev/??? is still taken,
+ *  which is why a system whose name has dots in it has to be given with
+ *  an @, if need be with nothing before it.
+ *
+ *  The rmt protocol answers every command in order, so there is no need
+ *  to wait for one answer before sending the next command.  We keep up to
+ *  RMT_DEPTH reads on the way at all times, which lets the link run at
+ *  its bandwidth rather than at one block per round trip.  Spacing
+ *  forward over a file is sent the same way, with the reads that follow
+ *  it queued behind; its answer is only looked at when the next record
+ *  is wanted.  Compiled in with REMOTE.
+ */
+
+#ifdef REMOTE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mtio.h>
+
+#include "tapeio.h"
+#include "rmt.h"
+
+/* How many reads we keep outstanding.  */
+#define RMT_DEPTH	32
+
+enum { RQ_READ, RQ_IOCTL };
+
+static int rmt_in = -1, rmt_out = -1;
+static pid_t rmt_pid;
+
+/* What each outstanding command is, oldest at Q_HEAD.  */
+static char rmt_queue[RMT_DEPTH + 2];
+static unsigned q_head, q_tail;
+static int q_reads;
+
+#define Q_LEN		(q_tail - q_head)
+#define Q_SLOT(i)	rmt_queue[(i) % sizeof (rmt_queue)]
+
+/* Bytes of the current answer not yet handed out, when reading a file
+   rather than a tape.  */
+static int rec_left;
+/* Tape marks handed out in a row; two of them end the tape.  */
+static int rmt_marks;
+static int rmt_eot;
+
+static unsigned char inbuf[8192];
+static int in_off, in_len;
+static char outbuf[1024];
+static int out_len;
+
+static void rmt_lost (void)
+{
+	fprintf(stderr, "lost connection to remote tape server\n");
+	exit(EXIT_FAILURE);
+}
+
+static void rmt_flush (void)
+{
+	int off, n;
+
+	for (off = 0; off < out_len; off += n) {
+		n = write(rmt_out, outbuf + off, out_len - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			rmt_lost ();
+		}
+	}
+	out_len = 0;
+}
+
+/* Queue a command of type KIND; it goes out with the next rmt_flush.  */
+static void rmt_send (int kind, char *cmd)
+{
+	int len = strlen (cmd);
+
+	if (sizeof (outbuf) - out_len < len)
+		rmt_flush ();
+	memcpy (outbuf + out_len, cmd, len);
+	out_len += len;
+	Q_SLOT (q_tail) = kind;
+	q_tail++;
+	if (kind == RQ_READ)
+		q_reads++;
+}
+
+static int rmt_getc (void)
+{
+	if (in_off == in_len) {
+		do
+			in_len = read(rmt_in, inbuf, sizeof (inbuf));
+		while (in_len < 0 && errno == EINTR);
+		if (in_len <= 0)
+			rmt_lost ();
+		in_off = 0;
+	}
+	return inbuf[in_off++];
+}
+
+static void rmt_line (char *buf, int size)
+{
+	int c, i = 0;
+
+	while ((c = rmt_getc ()) != '\n')
+		if (i < size - 1)
+			buf[i++] = c;
+	buf[i] = '\0';
+}
+
+/* Take the answer to the oldest command off the connection.  Returns
+   the number in an "A" answer, or -1 with errno set for an "E" answer.
+   Any data that comes with it is left for rmt_data.  */
+static int rmt_answer (void)
+{
+	char line[128];
+
+	rmt_flush ();
+	if (Q_SLOT (q_head) == RQ_READ)
+		q_reads--;
+	q_head++;
+	rmt_line (line, sizeof (line));
+	if (line[0] == 'A')
+		return atoi (line + 1);
+	if (line[0] == 'E' || line[0] == 'F') {
+		errno = atoi (line + 1);
+		rmt_line (line, sizeof (line));	/* the message */
+		return -1;
+	}
+	fprintf(stderr, "remote tape server: unexpected reply '%s'\n", line);
+	exit(EXIT_FAILURE);
+}
+
+/* Move the next N bytes of data to BUF, or throw them away if BUF is
+   NULL.  */
+static void rmt_data (unsigned char *buf, int n)
+{
+	int k;
+
+	while (n > 0) {
+		if (in_off < in_len) {
+			k = in_len - in_off < n ? in_len - in_off : n;
+			if (buf != NULL) {
+				memcpy (buf, inbuf + in_off, k);
+				buf += k;
+			}
+			in_off += k;
+		} else if (buf != NULL && n >= sizeof (inbuf)) {
+			/* Big enough to go straight where it belongs.  */
+			k = read(rmt_in, buf, n);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0)
+				rmt_lost ();
+			buf += k;
+		} else {
+			rmt_getc ();
+			in_off--;
+			continue;
+		}
+		n -= k;
+	}
+}
+
+/* Send more reads, as long as the tape is not known to be at its end.
+   Just after a tape mark we go one read at a time, so that we do not run
+   far past the double tape mark at the end of the tape.  */
+static void rmt_fill (void)
+{
+	char cmd[32];
+
+	sprintf (cmd, "R%d\n", TAPE_MAXREC);
+	while (!rmt_eot && q_reads < (rmt_marks ? 1 : RMT_DEPTH)
+	       && Q_LEN < sizeof (rmt_queue))
+		rmt_send (RQ_READ, cmd);
+}
+
+/* Throw away the answers to everything outstanding.  */
+static void rmt_drain (void)
+{
+	int n;
+
+	if (rec_left > 0)
+		rmt_data (NULL, rec_left);
+	rec_left = 0;
+	while (Q_LEN > 0) {
+		n = rmt_answer ();
+		if (n > 0)
+			rmt_data (NULL, n);
+	}
+}
+
+/* Is NAME a remote tape, that is, is there a colon before any slash?  */
+int rmt_remote (char *name)
+{
+	char *colon = strchr (name, ':');
+
+	return colon != NULL && colon > name
+		&& memchr (name, '/', colon - name) == NULL;
+}
+
+/* Start the server for the remote tape NAME and open the device.
+   Returns the descriptor we get the answers on, or -1 with errno set.  */
+int rmt_open (char *name)
+{
+	char *copy, *host, *user, *dev, *at;
+	char *rsh, *rmt;
+	int to[2], from[2];
+	char *cmd;
+	int n;
+
+	copy = host = strdup (name);
+	if (copy == NULL)
+		return -1;
+	dev = strchr (host, ':');
+	*dev++ = '\0';
+	user = NULL;
+	if ((at = strchr (host, '@')) != NULL) {
+		*at = '\0';
+		user = host;
+		host = at + 1;
+	} else if ((at = strchr (host, '.')) != NULL) {
+		*at = '\0';
+		user = at + 1;
+	}
+	if (user != NULL && *user == '\0')
+		user = NULL;
+	if ((rsh = getenv ("RSH")) == NULL)
+		rsh = "rsh";
+	if ((rmt = getenv ("RMT")) == NULL)
+		rmt = "/etc/rmt";
+
+	if (pipe (to) < 0)
+		return -1;
+	if (pipe (from) < 0) {
+		close (to[0]);
+		close (to[1]);
+		return -1;
+	}
+	rmt_pid = fork ();
+	if (rmt_pid < 0)
+		return -1;
+	if (rmt_pid == 0) {
+		dup2 (to[0], 0);
+		dup2 (from[1], 1);
+		close (to[0]);
+		close (to[1]);
+		close (from[0]);
+		close (from[1]);
+		if (user != NULL)
+			execlp (rsh, rsh, host, "-l", user, rmt, (char *)NULL);
+		else
+			execlp (rsh, rsh, host, rmt, (char *)NULL);
+		perror (rsh);
+		_exit (127);
+	}
+	close (to[0]);
+	close (from[1]);
+	rmt_out = to[1];
+	rmt_in = from[0];
+	/* If the server goes away we want to say so, not die quietly.  */
+	signal (SIGPIPE, SIG_IGN);
+
+	q_head = q_tail = q_reads = 0;
+	in_off = in_len = out_len = 0;
+	rec_left = rmt_marks = rmt_eot = 0;
+	cmd = malloc (strlen (dev) + 32);
+	if (cmd == NULL)
+		return -1;
+	sprintf (cmd, "O%s\n%d\n", dev, O_RDONLY);
+	rmt_send (RQ_IOCTL, cmd);
+	free (cmd);
+	n = rmt_answer ();
+	free (copy);
+	if (n < 0) {
+		int err = errno;
+
+		rmt_close ();
+		errno = err;
+		return -1;
+	}
+	return rmt_in;
+}
+
+/* Read the next record into BUF.  On a tape (WHOLE nonzero) a record
+   that does not fit in SIZE bytes is an error, as it is with the local
+   driver; a remote file is a stream of bytes and what does not fit is
+   kept for the next call.  Returns what read () would.  */
+int rmt_read (unsigned char *buf, int size, int whole)
+{
+	int n;
+
+	if (rec_left > 0) {
+		n = rec_left < size ? rec_left : size;
+		rmt_data (buf, n);
+		rec_left -= n;
+		return n;
+	}
+	if (rmt_eot)
+		return 0;
+	rmt_fill ();
+	while (Q_LEN > 0 && Q_SLOT (q_head) == RQ_IOCTL)
+		/* Something like an MTFSF sent ahead of the reads.  */
+		if (rmt_answer () < 0)
+			return -1;
+	n = rmt_answer ();
+	if (n < 0)
+		return -1;
+	if (n == 0) {
+		if (++rmt_marks == 2)
+			rmt_eot = 1;
+		return 0;
+	}
+	rmt_marks = 0;
+	if (n > size) {
+		if (whole) {
+			rmt_data (NULL, n);
+			errno = ENOMEM;
+			return -1;
+		}
+		rec_left = n - size;
+		n = size;
+	}
+	rmt_data (buf, n);
+	return n;
+}
+
+/* Do the magnetic tape operation OP COUNT times and wait for it to
+   finish.  Whatever had been read ahead is lost.  */
+int rmt_ioctl (int op, int count)
+{
+	char cmd[64];
+
+	rmt_drain ();
+	sprintf (cmd, "I%d\n%d\n", op, count);
+	rmt_send (RQ_IOCTL, cmd);
+	rmt_marks = rmt_eot = 0;
+	return rmt_answer () < 0 ? -1 : 0;
+}
+
+/* Skip forward past the next COUNT tape marks.  As far as the marks
+   are among what has already been read ahead, that is all there is to
+   it; for the rest the drive is told to space forward, and we carry on
+   without waiting.  */
+int rmt_skipfile (int count)
+{
+	char cmd[64];
+	int n;
+
+	if (rec_left > 0)
+		rmt_data (NULL, rec_left);
+	rec_left = 0;
+	while (Q_LEN > 0) {
+		if (Q_SLOT (q_head) == RQ_IOCTL) {
+			if (rmt_answer () < 0)
+				return -1;
+			continue;
+		}
+		n = rmt_answer ();
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			rmt_marks = 1;
+			if (--count == 0)
+				return 0;
+			continue;
+		}
+		rmt_data (NULL, n);
+	}
+	sprintf (cmd, "I%d\n%d\n", MTFSF, count);
+	rmt_send (RQ_IOCTL, cmd);
+	rmt_flush ();
+	rmt_marks = 1;
+	rmt_eot = 0;
+	return 0;
+}
+
+void rmt_close (void)
+{
+	if (rmt_out >= 0)
+		close (rmt_out);
+	if (rmt_in >= 0)
+		close (rmt_in);
+	rmt_in = rmt_out = -1;
+	if (rmt_pid > 0)
+		waitpid (rmt_pid, NULL, 0);
+	rmt_pid = 0;
+}
+
+#endif /* REMOTE */
@@ -0,0 +1,8 @@
+/* Remote tape access through rmt, see rmt.c.  */
+
+int rmt_remote (char *name);
+int rmt_open (char *name);
+int rmt_read (unsigned char *buf, int size, int whole);
+int rmt_ioctl (int op, int count);
+int rmt_skipfile (int count);
+void rmt_close (void);
@@ -0,0 +1,1229 @@
+/*
+ *  Saveset input for vmsbackup.
+ *
+ *  vmsbackup sees its input as a sequence of records.  On tape each
+ *  record is one tape block (or a tape mark, which reads as length 0);
+ *  for a saveset on disk the records are successive pieces of the
+ *  requested size.  Everything which knows how those records are
+ *  actually fetched lives in this file.
+ */
+
+/* Does this system have the magnetic tape ioctls?  The answer is yes for 
+   most/all unices, and I think it is yes for VMS 7.x with DECC 5.2 (needs
+   verification), but it is no for VMS 6.2.  */
+#ifndef HAVE_MT_IOCTLS
+#define HAVE_MT_IOCTLS 1
+#endif
+
+#ifdef HAVE_UNIXIO_H
+#include <unixio.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#if HAVE_MT_IOCTLS
+#include <sys/ioctl.h>
+#include <sys/mtio.h>
+#endif
+#ifdef REMOTE
+#include "rmt.h"
+#endif
+#include <sys/stat.h>
+#if defined(HAVE_MMAP) || defined(HAVE_PTHREAD)
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+#include "decompress.h"
+
+#include "vmsbackup.h"
+#include "tapeio.h"
+
+int	fd = -1;	/* tape file descriptor */
+
+#if HAVE_MT_IOCTLS
+static struct	mtop	op;
+#endif
+
+/* Nonzero if the open saveset is on disk.  */
+static int tape_ondisk;
+/* Nonzero if it is coming down a pipe, FIFO or socket, so that we can
+   neither seek in it nor map it.  */
+static int tape_stream;
+/* Tape marks passed since the tape was rewound.  */
+static int tape_files;
+/* Nonzero once we have started reading standard input ("-f -").  */
+static int stdin_used;
+
+#ifdef HAVE_DECOMPRESS
+/* Nonzero if the saveset is compressed, in which case it is read
+   through decompress.c.  */
+static int tape_compressed;
+#endif
+#ifdef REMOTE
+/* Nonzero if the tape is on another machine, see rmt.c.  */
+static int tape_remote;
+#endif
+/* Nonzero if the saveset is a SIMH tape image (see simh_next), which
+   we treat like a tape.  */
+static int tape_simh;
+/* The start of a saveset on disk, for magic numbers and tape_peek.
+   HEAD_LEN bytes of it are there.  From a stream we can only get them by
+   reading, so the PEEK_LEN bytes up to it still have to be handed on.  */
+#define PEEK_SIZE	512
+static unsigned char peekbuf[PEEK_SIZE];
+static int head_len, peek_len, peek_off;
+
+/* Read from the device itself.  */
+static int dev_read (unsigned char *buf, int size)
+{
+#ifdef REMOTE
+	if (tape_remote)
+		return rmt_read(buf, size, !tape_stream);
+#endif
+	return read(fd, buf, size);
+}
+
+/* Fill PEEKBUF with the first WANT bytes of a stream.  */
+static void stream_peek (int want)
+{
+	int n;
+
+	while (peek_len < want) {
+#ifdef HAVE_DECOMPRESS
+		if (tape_compressed)
+			n = decomp_read (peekbuf + peek_len, want - peek_len);
+		else
+#endif
+		n = dev_read(peekbuf + peek_len, want - peek_len);
+		if (n <= 0)
+			break;
+		peek_len += n;
+	}
+}
+
+/* Read up to SIZE bytes of a saveset on disk.  */
+static int stream_read (unsigned char *buf, int size)
+{
+	if (peek_off < peek_len) {
+		if (size > peek_len - peek_off)
+			size = peek_len - peek_off;
+		memcpy (buf, peekbuf + peek_off, size);
+		peek_off += size;
+		return size;
+	}
+#ifdef HAVE_DECOMPRESS
+	if (tape_compressed)
+		return decomp_read (buf, size);
+#endif
+	return dev_read(buf, size);
+}
+
+/* Buffer that tape_next reads into when the records are neither mapped
+   nor read ahead.  */
+static unsigned char *rbuf;
+static int rbuf_size;
+
+/* Make RBUF at least SIZE bytes.  */
+static unsigned char *rbuf_get (int size)
+{
+	if (size > rbuf_size) {
+		free (rbuf);
+		rbuf = (unsigned char *) malloc (size);
+		if (rbuf == NULL) {
+			fprintf(stderr, "memory allocation for block failed\n");
+			exit(EXIT_FAILURE);
+		}
+		rbuf_size = size;
+	}
+	return rbuf;
+}
+
+/* Read SIZE bytes from a saveset on disk.  A pipe in particular may
+   return less than we asked for; keep reading until we have it all or
+   the input ends.  */
+static int full_read (unsigned char *buf, int size)
+{
+	int n, got;
+
+	got = 0;
+	while (got < size) {
+		n = stream_read(buf + got, size - got);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	return got;
+}
+
+static int simh_read (unsigned char *buf, int size);
+
+/* Fetch one record straight from the device.  A tape gives us one
+   whole record per read (); anything else is a stream of bytes.  */
+static int raw_read (unsigned char *buf, int size)
+{
+	if (tape_simh)
+		return simh_read(buf, size);
+	if (!tape_ondisk)
+		return dev_read(buf, size);
+	return full_read(buf, size);
+}
+
+#ifdef HAVE_MMAP
+/* A saveset on disk is mapped rather than read, and tape_next hands out
+   pointers straight into the mapping.  MAP_BASE is NULL when the input
+   is not mapped.  */
+static unsigned char *map_base;
+static size_t map_size;
+/* Offset of the next record.  */
+static size_t map_off;
+/* Everything below this offset has already been given back.  */
+static size_t map_dropped;
+
+/* How much of the saveset we keep mapped behind the current record.
+   Once we are further ahead than this, the pages are dropped both from
+   our mapping and from the page cache, so that reading a saveset of
+   hundreds of gigabytes does not push everything else out of memory.  */
+#define MAP_WINDOW	(16 * 1024 * 1024)
+
+static void map_open (char *name)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size == 0)
+		return;
+	if ((off_t)(size_t)st.st_size != st.st_size)
+		return;		/* too big for our address space */
+	p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+#ifdef DEBUG
+		if (debugflag)
+			perror ("mmap");
+#endif
+		return;		/* fall back to read () */
+	}
+	map_base = p;
+	map_size = st.st_size;
+	map_off = 0;
+	map_dropped = 0;
+	madvise (map_base, map_size, MADV_SEQUENTIAL);
+}
+
+static void map_close (void)
+{
+	if (map_base == NULL)
+		return;
+	munmap (map_base, map_size);
+	map_base = NULL;
+}
+
+/* Give back the part of the mapping which lies more than MAP_WINDOW
+   behind the current position.  */
+static void map_release (void)
+{
+	size_t page = sysconf (_SC_PAGESIZE);
+	size_t upto;
+
+	if (map_off < map_dropped + 2 * MAP_WINDOW)
+		return;
+	upto = (map_off - MAP_WINDOW) & ~(page - 1);
+	madvise (map_base + map_dropped, upto - map_dropped, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise (fd, map_dropped, upto - map_dropped,
+		       POSIX_FADV_DONTNEED);
+#endif
+	map_dropped = upto;
+}
+
+static int map_next (unsigned char **bufp, int size)
+{
+	size_t n;
+
+	n = map_size - map_off;
+	if (n > size)
+		n = size;
+	*bufp = map_base + map_off;
+	map_off += n;
+	map_release ();
+	return n;
+}
+#endif
+
+#ifdef HAVE_PTHREAD
+/* Read-ahead.  With --buffer, a separate thread reads the tape into a
+   large ring while we are busy decoding and writing files, so that the
+   drive can keep streaming instead of stopping after every block.
+
+   The ring holds the records back to back, each preceded by a struct
+   ringrec and padded to RING_ALIGN.  When a record might not fit before
+   the end of the ring, the reader puts in a header with length
+   RING_WRAP and starts again at the beginning.  WPOS and RPOS count
+   bytes ever written and consumed, so WPOS - RPOS is the amount in use.
+   The reader does not care about saveset boundaries; it reads straight
+   on through the tape marks until it sees two in a row, which is the
+   end of the tape.  */
+#define RING_ALIGN	16
+#define RING_WRAP	(-2)
+
+struct ringrec {
+	int	len;		/* as returned by read () */
+	int	err;		/* errno, if LEN is -1 */
+	char	pad[RING_ALIGN - 2 * sizeof (int)];
+};
+
+static unsigned char *ring;
+static size_t ring_size;
+static size_t wpos, rpos;
+/* Bytes the record last handed out occupies; released on the next call.  */
+static size_t ring_held;
+/* How much to ask the device for in each read.  */
+static int ring_recsize;
+static int ring_done, ring_stop;
+static pthread_t ring_thread;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_notempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_notfull = PTHREAD_COND_INITIALIZER;
+
+#define RING_ROUND(n)	(((n) + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1))
+
+static void *ring_reader (void *arg)
+{
+	size_t need = sizeof (struct ringrec) + RING_ROUND (ring_recsize);
+	size_t off, skip;
+	struct ringrec *r;
+	int marks = 0;
+	int n;
+
+	for (;;) {
+		pthread_mutex_lock (&ring_lock);
+		off = wpos % ring_size;
+		skip = (ring_size - off < need) ? ring_size - off : 0;
+		while (!ring_stop && ring_size - (wpos - rpos) < skip + need)
+			pthread_cond_wait (&ring_notfull, &ring_lock);
+		if (ring_stop) {
+			pthread_mutex_unlock (&ring_lock);
+			break;
+		}
+		if (skip) {
+			((struct ringrec *)(ring + off))->len = RING_WRAP;
+			wpos += skip;
+			off = 0;
+		}
+		pthread_mutex_unlock (&ring_lock);
+
+		r = (struct ringrec *)(ring + off);
+		n = raw_read ((unsigned char *)(r + 1), ring_recsize);
+		r->len = n;
+		r->err = errno;
+
+		pthread_mutex_lock (&ring_lock);
+		wpos += sizeof (struct ringrec) + RING_ROUND (n > 0 ? n : 0);
+		marks = (n == 0) ? marks + 1 : 0;
+		/* Stop at a read error, at the end of a saveset on disk and
+		   at the double tape mark which ends a tape.  A record the
+		   drive could not read is passed on, and the tape read on
+		   past it.  */
+		if ((n < 0 && (tape_ondisk || r->err != EIO))
+		    || (n == 0 && (tape_ondisk || marks == 2)))
+			ring_done = 1;
+		pthread_cond_signal (&ring_notempty);
+		pthread_mutex_unlock (&ring_lock);
+		if (ring_done)
+			break;
+	}
+	return NULL;
+}
+
+static void ring_alloc (void)
+{
+	void *p = MAP_FAILED;
+
+	ring_size = tape_buffer & ~(size_t)(RING_ALIGN - 1);
+	if (ring_size < 4 * (TAPE_MAXREC + sizeof (struct ringrec)))
+		ring_size = 4 * (TAPE_MAXREC + sizeof (struct ringrec));
+#ifdef MAP_HUGETLB
+	if (flag_buffer_huge) {
+		/* Huge pages come in 2MB units on most machines.  */
+		ring_size = (ring_size + 0x1fffff) & ~(size_t)0x1fffff;
+		p = mmap (NULL, ring_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+			perror ("warning: no huge pages for read-ahead buffer");
+	}
+#endif
+	if (p == MAP_FAILED)
+		p = mmap (NULL, ring_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "memory allocation for read-ahead buffer failed\n");
+		exit(EXIT_FAILURE);
+	}
+#ifdef MADV_HUGEPAGE
+	if (flag_buffer_huge)
+		madvise (p, ring_size, MADV_HUGEPAGE);
+#endif
+	if (flag_buffer_lock && mlock (p, ring_size) < 0)
+		perror ("warning: cannot lock read-ahead buffer");
+	ring = p;
+}
+
+static void ring_start (int size)
+{
+	ring_recsize = tape_ondisk ? size : TAPE_MAXREC;
+	if (ring == NULL)
+		ring_alloc ();
+	wpos = rpos = ring_held = 0;
+	ring_done = ring_stop = 0;
+	if (pthread_create (&ring_thread, NULL, ring_reader, NULL) != 0) {
+		fprintf(stderr, "cannot start read-ahead thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void ring_end (void)
+{
+	if (ring == NULL)
+		return;
+	pthread_mutex_lock (&ring_lock);
+	ring_stop = 1;
+	pthread_cond_signal (&ring_notfull);
+	pthread_mutex_unlock (&ring_lock);
+	pthread_join (ring_thread, NULL);
+	munmap (ring, ring_size);
+	ring = NULL;
+}
+
+/* Hand out the next record from the ring.  The record stays in the ring
+   until the next call.  */
+static int ring_next (unsigned char **bufp, int size)
+{
+	struct ringrec *r;
+	size_t off;
+
+	pthread_mutex_lock (&ring_lock);
+	if (ring_held) {
+		rpos += ring_held;
+		ring_held = 0;
+		pthread_cond_signal (&ring_notfull);
+	}
+	for (;;) {
+		while (wpos == rpos && !ring_done)
+			pthread_cond_wait (&ring_notempty, &ring_lock);
+		if (wpos == rpos) {
+			/* Nothing more is coming.  */
+			pthread_mutex_unlock (&ring_lock);
+			return 0;
+		}
+		off = rpos % ring_size;
+		r = (struct ringrec *)(ring + off);
+		if (r->len != RING_WRAP)
+			break;
+		rpos += ring_size - off;
+	}
+	ring_held = sizeof (struct ringrec) + RING_ROUND (r->len > 0 ? r->len : 0);
+	pthread_mutex_unlock (&ring_lock);
+
+	*bufp = (unsigned char *)(r + 1);
+	if (r->len < 0)
+		errno = r->err;
+	else if (r->len > size) {
+		/* Same as what the driver does when a record does not fit.  */
+		errno = ENOMEM;
+		return -1;
+	}
+	return r->len;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/* Queued reads.  With --io-uring=DEPTH, a saveset on disk is read with
+   DEPTH reads in flight at once, which is what it takes to get near the
+   bandwidth of an NVMe drive or a network block device.  Slot K of UR_BUF
+   always holds the record with sequence number K modulo DEPTH, so the
+   records can be handed out in order however the reads complete.  */
+static struct uring ur;
+static int ur_active;
+static unsigned char *ur_buf;
+static int ur_recsize;
+static int *ur_len;		/* result of each slot's read */
+static unsigned long ur_seq;	/* sequence number of the next record */
+static unsigned long ur_submitted;	/* sequence number of the next read */
+static int ur_held;		/* a record has been handed out */
+static int ur_fixed;		/* UR_BUF is registered with the kernel */
+static int ur_eof;
+
+#define UR_PENDING	(-1 - 0x7fff)
+
+static void ur_queue (void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned slot;
+
+	while (!ur_eof && ur_submitted < ur_seq + uring_depth) {
+		sqe = uring_sqe (&ur);
+		if (sqe == NULL)
+			break;
+		slot = ur_submitted % uring_depth;
+		sqe->opcode = ur_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->off = (unsigned long long)ur_submitted * ur_recsize;
+		sqe->addr = (unsigned long)(ur_buf + (size_t)slot * ur_recsize);
+		sqe->len = ur_recsize;
+		sqe->buf_index = 0;
+		sqe->user_data = slot;
+		ur_len[slot] = UR_PENDING;
+		ur_submitted++;
+	}
+}
+
+/* Start queued reads of SIZE-byte records.  Returns 0, or -1 if io_uring
+   cannot be used here.  */
+static int ur_start (int size)
+{
+	size_t len = (size_t)uring_depth * size;
+
+	if (uring_init (&ur, uring_depth) < 0) {
+#ifdef DEBUG
+		if (debugflag)
+			perror ("io_uring");
+#endif
+		return -1;
+	}
+	ur_buf = mmap (NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ur_len = malloc (uring_depth * sizeof (int));
+	if (ur_buf == MAP_FAILED || ur_len == NULL) {
+		fprintf(stderr, "memory allocation for block failed\n");
+		exit(EXIT_FAILURE);
+	}
+	/* Registering the buffer saves mapping it for each read, but the
+	   kernel may refuse if it would exceed our locked memory limit.  */
+	ur_fixed = uring_register_buffer (&ur, ur_buf, len) == 0;
+	ur_recsize = size;
+	ur_seq = ur_submitted = 0;
+	ur_held = ur_eof = 0;
+	ur_active = 1;
+	ur_queue ();
+	return 0;
+}
+
+static void ur_end (void)
+{
+	if (!ur_active)
+		return;
+	/* Closing the ring cancels whatever is still in flight.  */
+	uring_exit (&ur);
+	munmap (ur_buf, (size_t)uring_depth * ur_recsize);
+	free (ur_len);
+	ur_active = 0;
+}
+
+static int ur_next (unsigned char **bufp, int size)
+{
+	struct io_uring_cqe *cqe;
+	unsigned slot;
+	int n;
+
+	if (ur_held) {
+		ur_seq++;
+		ur_held = 0;
+	}
+	ur_queue ();
+	slot = ur_seq % uring_depth;
+	while (ur_len[slot] == UR_PENDING) {
+		if (uring_submit (&ur, 1) < 0) {
+			perror ("io_uring_enter");
+			exit (EXIT_FAILURE);
+		}
+		while ((cqe = uring_peek (&ur)) != NULL) {
+			ur_len[cqe->user_data] = cqe->res;
+			uring_seen (&ur);
+		}
+	}
+	n = ur_len[slot];
+	*bufp = ur_buf + (size_t)slot * ur_recsize;
+	ur_held = 1;
+	if (n < ur_recsize)
+		/* End of the saveset (or an error); don't read past it.  */
+		ur_eof = 1;
+	if (n < 0) {
+		errno = -n;
+		return -1;
+	}
+	return n;
+}
+#endif
+
+/* SIMH tape images.  A .tap file holds the tape records back to back,
+   each with its length as a 32-bit little-endian word in front and again
+   behind it, and the data padded to an even length.  A length of zero is
+   a tape mark.  The top four bits of the word are the record class:
+   class 8 is a record the drive could not read properly, and a few other
+   values are markers without data, such as end of medium and erase gaps.
+   Records are handed out straight from the mapping when the image is
+   mapped, so vmsbackup sees the same record stream a drive would give it
+   without copying the blocks.  */
+#define SIMH_CLASS(w)	((w) >> 28)
+#define SIMH_LEN(w)	((w) & 0x0fffffff)
+#define SIMH_BAD	0x8
+#define SIMH_EOM	0xffffffff
+#define SIMH_GAP	0xfffffffe
+
+/* Set once we have seen the end of the medium or the end of the image;
+   from then on everything reads as a tape mark.  */
+static int simh_eom;
+
+/* Get the next N bytes of the image, or NULL if it ends first.  */
+static unsigned char *simh_get (unsigned long n)
+{
+	unsigned char *p;
+
+#ifdef HAVE_MMAP
+	if (map_base != NULL) {
+		if (n > map_size - map_off)
+			return NULL;
+		p = map_base + map_off;
+		map_off += n;
+		return p;
+	}
+#endif
+	if (n > 0x7fffffff)
+		return NULL;
+	p = rbuf_get (n);
+	if (full_read (p, n) != n)
+		return NULL;
+	return p;
+}
+
+static unsigned long simh_word (unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static int simh_next (unsigned char **bufp, int size)
+{
+	unsigned char *p;
+	unsigned long w, n;
+
+	while (!simh_eom) {
+		if ((p = simh_get (4)) == NULL)
+			break;
+		w = simh_word (p);
+		if (w == 0)
+			return 0;	/* tape mark */
+		if (w == SIMH_EOM)
+			break;
+		n = SIMH_LEN (w);
+		if (w == SIMH_GAP || SIMH_CLASS (w) == 0x7
+		    || SIMH_CLASS (w) >= 0xe)
+			continue;	/* markers without data */
+		/* The data, the padding and the trailing length.  */
+		if ((p = simh_get (n + (n & 1) + 4)) == NULL)
+			break;
+#ifdef HAVE_MMAP
+		if (map_base != NULL)
+			map_release ();
+#endif
+		if (SIMH_CLASS (w) == 0 || SIMH_CLASS (w) == SIMH_BAD) {
+			*bufp = p;
+			if (SIMH_CLASS (w) == SIMH_BAD) {
+				errno = EIO;
+				return -1;
+			}
+			if (n > size) {
+				errno = ENOMEM;
+				return -1;
+			}
+			return n;
+		}
+		/* Private and reserved classes have nothing for us.  */
+	}
+	simh_eom = 1;
+	return 0;
+}
+
+static int simh_read (unsigned char *buf, int size)
+{
+	unsigned char *p;
+	int n;
+
+	n = simh_next (&p, size);
+	if (n > 0)
+		memcpy (buf, p, n);
+	return n;
+}
+
+/* Does P, the first LEN bytes of a saveset, look like the start of a
+   SIMH image of a labelled tape?  A saveset on disk starts with a block
+   header, whose first longword is never 80.  */
+static int simh_probe (unsigned char *p, int len)
+{
+	return len >= 8 && simh_word (p) == 80
+		&& memcmp (p + 4, "VOL1", 4) == 0;
+}
+
+/* Writing SIMH tape images (--image-to).  The framed records are
+   collected in a large buffer which goes out in big write ()s, so that
+   the disk keeps up with a streaming drive.  */
+#define IMAGE_BUFSIZE	(8 * 1024 * 1024)
+
+static int img_fd = -1;
+static char *img_name;
+static unsigned char *img_buf;
+static size_t img_len;
+
+static void image_flush (void)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < img_len; off += n) {
+		n = write(img_fd, img_buf + off, img_len - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			perror(img_name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	img_len = 0;
+}
+
+static void image_word (unsigned long w)
+{
+	img_buf[img_len++] = w & 0xff;
+	img_buf[img_len++] = (w >> 8) & 0xff;
+	img_buf[img_len++] = (w >> 16) & 0xff;
+	img_buf[img_len++] = (w >> 24) & 0xff;
+}
+
+void image_create (char *name)
+{
+	img_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (img_fd < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	img_name = name;
+	img_buf = malloc (IMAGE_BUFSIZE);
+	if (img_buf == NULL) {
+		fprintf(stderr, "memory allocation for image buffer failed\n");
+		exit(EXIT_FAILURE);
+	}
+	img_len = 0;
+}
+
+/* Add the LEN-byte record at BUF to the image; a LEN of 0 is a tape
+   mark.  */
+void image_write (unsigned char *buf, int len)
+{
+	if (IMAGE_BUFSIZE - img_len < len + 9)
+		image_flush ();
+	image_word (len);
+	if (len == 0)
+		return;
+	memcpy (img_buf + img_len, buf, len);
+	img_len += len;
+	if (len & 1)
+		img_buf[img_len++] = 0;
+	image_word (len);
+}
+
+/* Add a record that could not be read, as a bad data record (class 8)
+   with no data.  */
+void image_bad (void)
+{
+	if (IMAGE_BUFSIZE - img_len < 8)
+		image_flush ();
+	image_word ((unsigned long)SIMH_BAD << 28);
+	image_word ((unsigned long)SIMH_BAD << 28);
+}
+
+void image_close (void)
+{
+	/* The last record may have filled the buffer.  */
+	if (IMAGE_BUFSIZE - img_len < 4)
+		image_flush ();
+	image_word (SIMH_EOM);
+	image_flush ();
+	if (close(img_fd) < 0) {
+		perror(img_name);
+		exit(EXIT_FAILURE);
+	}
+	free (img_buf);
+	img_buf = NULL;
+	img_fd = -1;
+}
+
+/* Open the saveset NAME and rewind it.  Returns nonzero if NAME is a
+   saveset on disk rather than a tape.  Does not return on error.  */
+int tape_open (char *name)
+{
+	int	ondisk = 0;
+#if HAVE_MT_IOCTLS
+	int	i;
+#endif
+
+	tape_close ();
+	tape_stream = 0;
+	if (strcmp (name, "-") == 0) {
+		fd = STDIN_FILENO;
+		if (stdin_used && lseek(fd, 0, SEEK_SET) < 0) {
+			fprintf(stderr,
+				"cannot go back to the start of standard input\n");
+			exit(EXIT_FAILURE);
+		}
+		stdin_used = 1;
+	}
+#ifdef REMOTE
+	else if (rmt_remote (name)) {
+		fd = rmt_open(name);
+		tape_remote = 1;
+	}
+#endif
+	else
+		fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+#ifdef S_ISFIFO
+#ifdef REMOTE
+	if (!tape_remote)
+#endif
+	{
+		struct stat st;
+
+		if (fstat (fd, &st) == 0
+		    && (S_ISFIFO (st.st_mode) || S_ISSOCK (st.st_mode)))
+			tape_stream = 1;
+	}
+	if (tape_stream)
+		/* Certainly not a tape, and asking would be no use.  */
+		ondisk = 1;
+	else {
+#endif
+#if HAVE_MT_IOCTLS
+	/* rewind the tape */
+	op.mt_op = MTREW;
+	op.mt_count = 1;
+#ifdef REMOTE
+	if (tape_remote)
+		i = rmt_ioctl(MTREW, 1);
+	else
+#endif
+	i = ioctl(fd, MTIOCTOP, &op);
+	if (i < 0) {
+		if (errno == EINVAL || errno == ENOTTY) {
+			ondisk = 1;
+		} else {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+	}
+#else
+	ondisk = 1;
+#endif
+#ifdef S_ISFIFO
+	}
+#endif
+#ifdef REMOTE
+	if (tape_remote && ondisk)
+		/* A file on the other machine; all we can do is read it.  */
+		tape_stream = 1;
+#endif
+	head_len = peek_len = peek_off = 0;
+	tape_simh = simh_eom = 0;
+	tape_files = 0;
+#ifdef HAVE_DECOMPRESS
+	tape_compressed = 0;
+	if (ondisk
+#ifdef REMOTE
+	    && !tape_remote	/* decompress.c reads FD itself */
+#endif
+	    ) {
+		if (tape_stream)
+			/* The only way to see the magic number is to read
+			   it, so keep what we read for stream_read.  */
+			stream_peek (8);
+		if (decomp_open (fd, peekbuf, peek_len)) {
+			tape_compressed = 1;
+			/* What we get is a stream, which we can neither map
+			   nor read through io_uring.  */
+			tape_stream = 1;
+			peek_len = 0;
+		}
+	}
+#endif
+	if (ondisk) {
+		if (tape_stream) {
+			stream_peek (PEEK_SIZE);
+			head_len = peek_len;
+		} else {
+			head_len = read(fd, peekbuf, PEEK_SIZE);
+			if (head_len < 0 || lseek(fd, 0, SEEK_SET) < 0)
+				head_len = 0;
+		}
+		tape_simh = simh_probe (peekbuf, head_len);
+	}
+#ifdef HAVE_MMAP
+	if (ondisk && !tape_stream
+#ifdef HAVE_IO_URING
+	    && (uring_depth == 0 || tape_simh)
+#endif
+	    )
+		map_open (name);
+#endif
+	if (tape_simh)
+		/* A tape image, so from here on it is a tape.  */
+		ondisk = 0;
+	tape_ondisk = ondisk;
+	return ondisk;
+}
+
+/* Let the caller look at the start of a saveset on disk before reading
+   it, to find out how big its blocks are.  Sets *BUFP to point to the
+   first bytes of the saveset and returns how many there are; there is
+   nothing to see for a tape.  */
+int tape_peek (unsigned char **bufp)
+{
+	*bufp = peekbuf;
+	return tape_ondisk ? head_len : 0;
+}
+
+/* Keep count of the tape marks as we read them.  */
+static int count_mark (int n)
+{
+	if (n == 0 && !tape_ondisk)
+		tape_files++;
+	return n;
+}
+
+/* Read the next record, which must fit in SIZE bytes, into BUF.  Returns
+   the length of the record, 0 at a tape mark (or the end of a saveset
+   on disk), or -1 on error.  This is meant for the small label records;
+   blocks should be read with tape_next.  */
+int tape_read (char *buf, int size)
+{
+#ifdef HAVE_PTHREAD
+	unsigned char *p;
+	int n;
+
+	if (tape_buffer > 0) {
+		n = tape_next (&p, size);
+		if (n > 0)
+			memcpy (buf, p, n);
+		return n;
+	}
+#endif
+	return count_mark (raw_read((unsigned char *)buf, size));
+}
+
+static int next_record (unsigned char **bufp, int size)
+{
+	if (tape_simh
+#ifdef HAVE_PTHREAD
+	    && tape_buffer == 0
+#endif
+	    )
+		return simh_next (bufp, size);
+#ifdef HAVE_MMAP
+	if (map_base != NULL && !tape_simh)
+		return map_next (bufp, size);
+#endif
+#ifdef HAVE_IO_URING
+	if (tape_ondisk && !tape_stream && uring_depth > 0) {
+		if (ur_active || ur_start (size) == 0)
+			return ur_next (bufp, size);
+		/* No io_uring here; carry on with read ().  */
+		uring_depth = 0;
+	}
+#endif
+#ifdef HAVE_PTHREAD
+	if (tape_buffer > 0) {
+		if (ring == NULL)
+			ring_start (size);
+		return ring_next (bufp, size);
+	}
+#endif
+	*bufp = rbuf_get (size);
+	return raw_read(rbuf, size);
+}
+
+/* Get the next record of at most SIZE bytes.  *BUFP is set to point
+   to it; the data stays valid until the next call.  Returns the same as
+   tape_read.  */
+int tape_next (unsigned char **bufp, int size)
+{
+	return count_mark (next_record (bufp, size));
+}
+
+static int skip_file (void)
+{
+#ifdef HAVE_PTHREAD
+	unsigned char *p;
+	int n;
+
+	if (tape_buffer > 0) {
+		/* The drive is already somewhere ahead of us, so spacing
+		   it would lose what has been read.  Skip through the ring
+		   instead.  */
+		while ((n = next_record (&p, TAPE_MAXREC)) > 0)
+			;
+		return n;
+	}
+#endif
+	if (tape_simh) {
+		unsigned char *p;
+
+		/* Bad records are skipped just like good ones.  */
+		while (simh_next (&p, 0x7fffffff) != 0)
+			;
+		return 0;
+	}
+#ifdef REMOTE
+	if (tape_remote)
+		return rmt_skipfile(1);
+#endif
+#if HAVE_MT_IOCTLS
+	op.mt_op = MTFSF;
+	op.mt_count = 1;
+	return ioctl(fd, MTIOCTOP, &op);
+#else
+	abort ();
+#endif
+}
+
+/* Skip forward past the next tape mark.  Returns 0 on success, -1 on
+   error.  */
+int tape_skipfile (void)
+{
+	int n;
+
+	n = skip_file ();
+	if (n == 0)
+		tape_files++;
+	return n;
+}
+
+/* How many tape marks we have passed since the tape was rewound.  */
+int tape_fileno (void)
+{
+	return tape_files;
+}
+
+/* Nonzero if the tape is a SIMH image, whose tape_block numbers are
+   byte offsets rather than blocks on a drive.  */
+int tape_image (void)
+{
+	return tape_simh;
+}
+
+/* Where we are on the tape, as a block number for tape_seekfile, or -1
+   if that cannot be known.  */
+long tape_block (void)
+{
+#ifdef HAVE_PTHREAD
+	if (tape_buffer > 0)
+		return -1;	/* the drive is somewhere ahead */
+#endif
+	if (tape_simh) {
+#ifdef HAVE_MMAP
+		if (map_base != NULL)
+			return map_off;
+#endif
+		return -1;
+	}
+#ifdef REMOTE
+	if (tape_remote)
+		return -1;
+#endif
+#ifdef MTIOCPOS
+	{
+		struct mtpos pos;
+
+		if (ioctl(fd, MTIOCPOS, &pos) == 0)
+			return pos.mt_blkno;
+	}
+#endif
+	return -1;
+}
+
+/* Go to the start of the tape file which follows the FILEth tape mark
+   and starts at block BLOCK (from tape_block), or at an unknown block
+   if BLOCK is -1.  We seek straight to the block if the drive lets us,
+   and otherwise space forward over all the files in one go.  Returns 0
+   on success, or -1 if we cannot get there from here.  */
+int tape_seekfile (int file, long block)
+{
+	int n;
+
+#ifdef HAVE_PTHREAD
+	if (tape_buffer > 0)
+		return -1;	/* see tape_skipfile */
+#endif
+	if (block >= 0) {
+#ifdef HAVE_MMAP
+		if (tape_simh && map_base != NULL) {
+			if (block > map_size)
+				return -1;
+			map_off = block;
+			simh_eom = 0;
+			tape_files = file;
+			return 0;
+		}
+#endif
+#ifdef MTSEEK
+		if (!tape_simh
+#ifdef REMOTE
+		    && !tape_remote
+#endif
+		    ) {
+			op.mt_op = MTSEEK;
+			op.mt_count = block;
+			if (ioctl(fd, MTIOCTOP, &op) == 0) {
+				tape_files = file;
+				return 0;
+			}
+		}
+#endif
+	}
+	n = file - tape_files;
+	if (n < 0)
+		return -1;
+#if HAVE_MT_IOCTLS
+	if (n > 0 && !tape_simh
+#ifdef REMOTE
+	    && !tape_remote
+#endif
+	    ) {
+		op.mt_op = MTFSF;
+		op.mt_count = n;
+		if (ioctl(fd, MTIOCTOP, &op) < 0)
+			return -1;
+		tape_files = file;
+		return 0;
+	}
+#endif
+#ifdef REMOTE
+	if (n > 0 && tape_remote) {
+		if (rmt_skipfile(n) < 0)
+			return -1;
+		tape_files = file;
+		return 0;
+	}
+#endif
+	while (n-- > 0)
+		if (tape_skipfile () < 0)
+			return -1;
+	return 0;
+}
+
+/* Position of the input, for debugging output.  */
+long tape_tell (void)
+{
+#ifdef HAVE_MMAP
+	if (map_base != NULL)
+		return map_off;
+#endif
+#ifdef HAVE_IO_URING
+	if (ur_active)
+		return (long)(ur_seq + 1) * ur_recsize;
+#endif
+	return lseek(fd, 0, SEEK_CUR);
+}
+
+/* Nonzero if what tape_next hands out stays valid after the next call,
+   as it does when the saveset is mapped.  */
+int tape_stable (void)
+{
+#ifdef HAVE_MMAP
+	return map_base != NULL && !tape_simh;
+#else
+	return 0;
+#endif
+}
+
+/* Nonzero if tape_next hands out just as many bytes as are asked for,
+   rather than whole records, so that a saveset on disk can be read from
+   any offset.  */
+int tape_bytes (void)
+{
+	if (!tape_ondisk)
+		return 0;
+#ifdef HAVE_MMAP
+	if (map_base != NULL)
+		return 1;
+#endif
+#ifdef HAVE_IO_URING
+	if (!tape_stream && uring_depth > 0)
+		return 0;
+#endif
+#ifdef HAVE_PTHREAD
+	if (tape_buffer > 0)
+		return 0;
+#endif
+	return 1;
+}
+
+/* Where the byte at P, in a record from tape_next, is in the saveset
+   file, or -1 if it did not come straight from there.  That is only
+   known when the saveset is mapped.  */
+long tape_offset (const unsigned char *p)
+{
+#ifdef HAVE_MMAP
+	if (map_base != NULL && p >= map_base && p < map_base + map_size)
+		return p - map_base;
+#endif
+	return -1;
+}
+
+void tape_close (void)
+{
+	if (fd < 0)
+		return;
+#ifdef HAVE_PTHREAD
+	ring_end ();
+#endif
+#ifdef HAVE_IO_URING
+	ur_end ();
+#endif
+#ifdef HAVE_DECOMPRESS
+	if (tape_compressed)
+		decomp_close ();
+	tape_compressed = 0;
+#endif
+#ifdef HAVE_MMAP
+	map_close ();
+#endif
+#ifdef REMOTE
+	if (tape_remote)
+		rmt_close();
+	else
+#endif
+	if (fd != STDIN_FILENO)
+		close(fd);
+#ifdef REMOTE
+	tape_remote = 0;
+#endif
+	fd = -1;
+}
@@ -0,0 +1,27 @@
+/* Saveset input, see tapeio.c.  */
+
+extern int fd;
+
+/* The largest record we ask the drive for.  BACKUP never writes tape
+   blocks larger than this.  */
+#define TAPE_MAXREC	65536
+
+int tape_open (char *name);
+int tape_peek (unsigned char **bufp);
+int tape_read (char *buf, int size);
+int tape_next (unsigned char **bufp, int size);
+int tape_skipfile (void);
+int tape_fileno (void);
+long tape_block (void);
+int tape_image (void);
+int tape_seekfile (int file, long block);
+long tape_tell (void);
+int tape_stable (void);
+int tape_bytes (void);
+long tape_offset (const unsigned char *p);
+void tape_close (void);
+
+void image_create (char *name);
+void image_write (unsigned char *buf, int len);
+void image_bad (void);
+void image_close (void);
@@ -0,0 +1,200 @@
+/*
+ *  A stand-in for rmt(8), for tests/rmt.sh.  It speaks the rmt protocol
+ *  on its standard input and output, as the real one does under rsh, and
+ *  plays the SIMH tape image it is asked to open as if it were a tape
+ *  drive: R hands out one record, a tape mark reads as a record of
+ *  length 0, and I does MTREW and MTFSF.  A bad record (class 8) is
+ *  answered with EIO.
+ *
+ *  What it was asked to do goes to the file named by FAKERMT_LOG, one
+ *  line per command.  Before it answers the first read it waits a moment
+ *  for more commands and notes how many reads were queued behind it,
+ *  which is how the test sees that the client does not wait for each
+ *  answer before asking again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mtio.h>
+
+static FILE *tape, *logf;
+static int tape_eom;
+
+static void answer (int n)
+{
+	printf ("A%d\n", n);
+}
+
+static void error (int err)
+{
+	printf ("E%d\n%s\n", err, strerror (err));
+}
+
+static unsigned long word (void)
+{
+	unsigned char p[4];
+
+	if (fread (p, 1, 4, tape) != 4)
+		return 0xffffffff;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Move on to the next record or tape mark.  Returns its length and
+   class, with the data in BUF; -1 at the end of the medium.  */
+static long next (unsigned char *buf, size_t size, int *class)
+{
+	unsigned long w, n;
+
+	while (!tape_eom) {
+		w = word ();
+		if (w == 0xffffffff)
+			break;
+		if (w == 0xfffffffe)
+			continue;
+		n = w & 0x0fffffff;
+		*class = w >> 28;
+		if (n > size)
+			break;
+		if (n > 0 && fread (buf, 1, n + (n & 1), tape) != n + (n & 1))
+			break;
+		if (w != 0)
+			word ();
+		return n;
+	}
+	tape_eom = 1;
+	return -1;
+}
+
+/* Standard input, read by hand so that we can tell what is waiting.  */
+static char in[0x10000];
+static int in_off, in_len;
+
+/* Take in whatever has arrived, waiting up to MS milliseconds for
+   something.  Returns 0 if nothing came.  */
+static int fill (int ms)
+{
+	struct pollfd pfd;
+	int n;
+
+	if (in_off > 0) {
+		memmove (in, in + in_off, in_len - in_off);
+		in_len -= in_off;
+		in_off = 0;
+	}
+	pfd.fd = 0;
+	pfd.events = POLLIN;
+	if (in_len == sizeof (in) || poll (&pfd, 1, ms) <= 0)
+		return 0;
+	n = read (0, in + in_len, sizeof (in) - in_len);
+	if (n <= 0)
+		return 0;
+	in_len += n;
+	return 1;
+}
+
+/* The next line of input, without its newline, or NULL at the end.  */
+static char *line (void)
+{
+	char *p, *nl;
+
+	while ((nl = memchr (in + in_off, '\n', in_len - in_off)) == NULL)
+		if (!fill (-1))
+			return NULL;
+	p = in + in_off;
+	*nl = '\0';
+	in_off = nl + 1 - in;
+	return p;
+}
+
+/* How many R commands are waiting after the one being done.  */
+static int queued_reads (void)
+{
+	int i, n;
+
+	usleep (200000);
+	while (fill (0))
+		;
+	n = 0;
+	for (i = in_off; i < in_len; i++)
+		if (in[i] == 'R' && (i == in_off || in[i - 1] == '\n'))
+			n++;
+	return n;
+}
+
+int main (void)
+{
+	static unsigned char buf[0x10000];
+	char *cmd, *arg, *log, name[1024];
+	int reads, class, op, count;
+	long n;
+
+	log = getenv ("FAKERMT_LOG");
+	logf = fopen (log != NULL ? log : "/dev/null", "a");
+	if (logf == NULL)
+		return 1;
+	setvbuf (logf, NULL, _IONBF, 0);
+	reads = 0;
+	while ((cmd = line ()) != NULL) {
+		switch (cmd[0]) {
+		case 'O':
+			/* The next line may move this one.  */
+			snprintf (name, sizeof (name), "%s", cmd + 1);
+			if ((arg = line ()) == NULL)
+				return 1;
+			fprintf (logf, "open %s\n", name);
+			tape = fopen (name, "rb");
+			tape_eom = 0;
+			if (tape == NULL)
+				error (errno);
+			else
+				answer (0);
+			break;
+		case 'R':
+			if (reads++ == 0)
+				fprintf (logf, "queued %d\n", queued_reads ());
+			n = next (buf, sizeof (buf), &class);
+			if (n < 0)
+				answer (0);
+			else if (class == 8)
+				error (EIO);
+			else {
+				answer (n);
+				fwrite (buf, 1, n, stdout);
+			}
+			break;
+		case 'I':
+			op = atoi (cmd + 1);
+			if ((arg = line ()) == NULL)
+				return 1;
+			count = atoi (arg);
+			fprintf (logf, "ioctl %d %d\n", op, count);
+			if (op == MTREW) {
+				rewind (tape);
+				tape_eom = 0;
+			} else if (op == MTFSF)
+				while (count > 0
+				       && (n = next (buf, sizeof (buf), &class)) >= 0)
+					if (n == 0)
+						count--;
+			answer (0);
+			break;
+		case 'C':
+			fprintf (logf, "close\n");
+			if (tape != NULL)
+				fclose (tape);
+			tape = NULL;
+			answer (0);
+			break;
+		default:
+			error (EINVAL);
+			break;
+		}
+		fflush (stdout);
+	}
+	return 0;
+}
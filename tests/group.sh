@@ -0,0 +1,67 @@
+#!/bin/sh
+# Read savesets with redundancy groups.  tests/group.tap holds one
+# written with /GROUP_SIZE=4: after every four blocks comes an XOR
+# block, whose header is that of the last block in the group with
+# bit 1 (BBH_M_XOR) set in bbh_l_flags, and whose data is the XOR of
+# the group's data.  The others are copies of it with something wrong:
+#
+#   group-bad.tap    block 3 is unreadable, and can be rebuilt
+#   group-last.tap   block 9, in the last group of two, is unreadable,
+#                    and can be rebuilt
+#   group-lost.tap   block 3 is unreadable, and there are no XOR blocks
+#   group-stray.tap  block 3 is marked as an XOR block, out of place
+#
+# These were made to the layout described above, not by BACKUP itself.
+# Run by "make check" from the top directory.
+
+B=${B:-./vmsbackup}
+W=$(mktemp -d) || exit 1
+trap 'rm -rf "$W"' 0
+
+VMSBACKUP_TOC=$W/toc
+export VMSBACKUP_TOC
+
+fail=0
+bad () {
+	echo "FAIL: $*"
+	fail=1
+}
+
+# run NAME [OPTIONS]: extract tests/NAME.tap into $W/NAME, with the
+# messages in $W/NAME.err and the exit status in $rc.
+run () {
+	name=$1
+	shift
+	mkdir "$W/$name"
+	(cd "$W/$name" && $OLDPWD/$B -xd --verify-crc "$@" \
+		-f "$OLDPWD/tests/$name.tap" > /dev/null 2> "$W/$name.err")
+	rc=$?
+}
+
+run group
+[ $rc = 0 ] || bad "group.tap exited with $rc"
+[ -s "$W/group.err" ] && bad "group.tap: $(cat "$W/group.err")"
+
+run group-bad
+[ $rc = 0 ] || bad "group-bad.tap exited with $rc"
+grep -q "^Block 3: rebuilt" "$W/group-bad.err" || bad "block 3 not rebuilt"
+grep -q "error reading" "$W/group-bad.err" && bad "read error for block 3"
+diff -r "$W/group" "$W/group-bad" > /dev/null || bad "rebuilt files differ"
+
+run group-last
+[ $rc = 0 ] || bad "group-last.tap exited with $rc"
+grep -q "^Block 9: rebuilt" "$W/group-last.err" || bad "block 9 not rebuilt"
+diff -r "$W/group" "$W/group-last" > /dev/null ||
+	bad "files rebuilt from the last group differ"
+
+run group-lost
+[ $rc = 0 ] && bad "group-lost.tap exited with 0"
+grep -q "^Block 3: lost" "$W/group-lost.err" || bad "block 3 not lost"
+
+run group-stray
+[ $rc = 0 ] && bad "group-stray.tap exited with 0"
+grep -q "^Block 3: XOR block out of place" "$W/group-stray.err" ||
+	bad "block 3 not reported out of place"
+
+[ $fail = 0 ] && echo "group: all tests passed"
+exit $fail
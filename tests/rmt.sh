@@ -0,0 +1,59 @@
+#!/bin/sh
+# Read tests/two.tap, a SIMH image of a tape with two savesets, through
+# rmt.c from tests/fakermt, which plays it as a remote tape drive, and
+# check that everything comes out as it does when the image is read
+# here.  Run by "make check" from the top directory.
+
+B=${B:-tests/vmsbackup-remote}
+T=$PWD/tests/two.tap
+W=$(mktemp -d) || exit 1
+trap 'rm -rf "$W"' 0
+
+RSH=$PWD/tests/rsh
+RMT=$PWD/tests/fakermt
+FAKERMT_LOG=$W/log
+VMSBACKUP_TOC=$W/toc
+export RSH RMT FAKERMT_LOG VMSBACKUP_TOC
+
+fail=0
+bad () {
+	echo "FAIL: $*"
+	fail=1
+}
+
+# The system and user rsh is asked for, for each form of the name.
+for case in "sys:$T|sys " "jim@sys:$T|sys jim" "sys.jim:$T|sys jim" \
+	    "@sys.example.com:$T|sys.example.com "; do
+	name=${case%%|*}
+	want=${case#*|}
+	: > "$W/log"
+	$B -t -f "$name" > "$W/remote" 2>&1
+	$B -t -f "$T" > "$W/local" 2>&1
+	cmp -s "$W/local" "$W/remote" || bad "listing of $name"
+	grep -qx "rsh $want" "$W/log" || bad "$name gave $(grep rsh "$W/log")"
+done
+
+# The reads must have been sent without waiting for the answers.
+n=$(sed -n 's/^queued //p' "$W/log")
+[ "${n:-0}" -gt 1 ] || bad "only ${n:-0} reads queued behind the first"
+
+# The second saveset, skipped to with the drive spaced forward, and
+# then found from the table of contents the listings above made.
+VMSBACKUP_TOC=$W/r $B -t -s 2 -f "sys:$T" > "$W/remote" 2>&1
+VMSBACKUP_TOC=$W/l $B -t -s 2 -f "$T" > "$W/local" 2>&1
+cmp -s "$W/local" "$W/remote" || bad "listing with -s 2"
+$B -t -s 2 -f "sys:$T" > "$W/remote" 2>&1
+$B -t -s 2 -f "$T" > "$W/local" 2>&1
+cmp -s "$W/local" "$W/remote" || bad "listing with -s 2 from the table"
+
+# Extracting, and a copy of the whole tape.
+mkdir "$W/xl" "$W/xr"
+(cd "$W/xl" && $OLDPWD/$B -xd -f "$T" > /dev/null 2>&1)
+(cd "$W/xr" && $OLDPWD/$B -xd -f "sys:$T" > /dev/null 2>&1)
+diff -r "$W/xl" "$W/xr" > /dev/null || bad "extracted files"
+$B --image-to="$W/copy.tap" -f "sys:$T" > /dev/null 2>&1
+$B --image-to="$W/copyl.tap" -f "$T" > /dev/null 2>&1
+cmp -s "$W/copy.tap" "$W/copyl.tap" || bad "--image-to"
+
+[ $fail = 0 ] && echo "rmt: all tests passed"
+exit $fail
@@ -0,0 +1,198 @@
+/*
+ *  Tables of contents of tapes.  Whenever vmsbackup reads the labels of
+ *  a saveset on a tape it notes which tape file they are in and, if the
+ *  drive can tell, at which block that file starts.  The notes are kept
+ *  from one run to the next, one file per tape volume, named after the
+ *  volume label, in the directory $VMSBACKUP_TOC (by default
+ *  $HOME/.vmsbackup).  With -s, a later run can then go straight to the
+ *  saveset it wants instead of spacing over the ones before it.
+ *
+ *  A label says nothing about whether it is on a tape or in a SIMH image
+ *  of one, and the block numbers are not the same thing in the two (a
+ *  block on the drive, a byte offset in the image), so each entry says
+ *  which it was noted on and is only used for the same kind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "vmsbackup.h"
+#include "toc.h"
+
+struct tocent {
+	int	setnr;
+	int	file;		/* tape marks before the saveset's labels */
+	long	block;		/* where they start, or -1 */
+	int	image;		/* nonzero if noted on a SIMH image */
+	char	name[20];
+};
+
+static struct tocent *toc;
+static int toc_count, toc_alloc;
+/* The file for the current volume, or NULL if we have none.  */
+static char *toc_path;
+static int toc_changed;
+
+static char *toc_dir (void)
+{
+	static char *dir;
+	char *home;
+
+	if (dir != NULL)
+		return dir;
+	if ((dir = getenv ("VMSBACKUP_TOC")) != NULL)
+		return dir;
+	if ((home = getenv ("HOME")) == NULL)
+		return NULL;
+	dir = malloc (strlen (home) + sizeof ("/.vmsbackup"));
+	if (dir != NULL)
+		sprintf (dir, "%s/.vmsbackup", home);
+	return dir;
+}
+
+/* Start on the table of contents for the tape with volume label
+   VOLUME, reading what earlier runs found out about it.  */
+void toc_load (char *volume)
+{
+	char line[128], name[20], medium[10];
+	struct tocent e;
+	char *dir, *p;
+	FILE *f;
+
+	toc_count = 0;
+	toc_changed = 0;
+	free (toc_path);
+	toc_path = NULL;
+	if ((dir = toc_dir ()) == NULL || *volume == '\0')
+		return;
+	toc_path = malloc (strlen (dir) + strlen (volume) + 6);
+	if (toc_path == NULL)
+		return;
+	sprintf (toc_path, "%s/%s.toc", dir, volume);
+	/* The label is whatever the tape says; keep it to a file name.  */
+	for (p = toc_path + strlen (dir) + 1; *p != '\0'; p++)
+		if (!isalnum ((unsigned char)*p) && *p != '.' && *p != '-'
+		    && *p != '_' && *p != '$')
+			*p = '_';
+
+	if ((f = fopen (toc_path, "r")) == NULL)
+		return;
+	while (fgets (line, sizeof (line), f) != NULL) {
+		if (line[0] == '#')
+			continue;
+		name[0] = '\0';
+		/* Lines from before there was a medium are dropped.  */
+		if (sscanf (line, "%d %d %ld %9s %19s", &e.setnr, &e.file,
+			    &e.block, medium, name) < 4)
+			continue;
+		if (strcmp (medium, "tape") == 0)
+			e.image = 0;
+		else if (strcmp (medium, "image") == 0)
+			e.image = 1;
+		else
+			continue;
+		toc_note (e.setnr, name, e.file, e.block, e.image);
+	}
+	fclose (f);
+	toc_changed = 0;
+#ifdef DEBUG
+	if (debugflag)
+		printf ("%d savesets in %s\n", toc_count, toc_path);
+#endif
+}
+
+/* Look up saveset SETNR on a tape, or in an image if IMAGE is nonzero.
+   Returns 1 and sets *FILE and *BLOCK if we know where it is.  */
+int toc_find (int setnr, int image, int *file, long *block)
+{
+	int i;
+
+	for (i = 0; i < toc_count; i++)
+		if (toc[i].setnr == setnr && toc[i].image == image) {
+			*file = toc[i].file;
+			*block = toc[i].block;
+			return 1;
+		}
+	return 0;
+}
+
+/* The labels of saveset SETNR, called NAME, are in tape file FILE, which
+   starts at BLOCK, on a tape or in an image if IMAGE is nonzero.  */
+void toc_note (int setnr, char *name, int file, long block, int image)
+{
+	struct tocent *e;
+	int i;
+
+	for (i = 0; i < toc_count; i++)
+		if (toc[i].setnr == setnr && toc[i].image == image)
+			break;
+	if (i == toc_count) {
+		if (toc_count == toc_alloc) {
+			toc_alloc = toc_alloc ? 2 * toc_alloc : 32;
+			e = realloc (toc, toc_alloc * sizeof (*toc));
+			if (e == NULL)
+				return;
+			toc = e;
+		}
+		toc_count++;
+	} else if (toc[i].file == file && toc[i].block == block
+		   && strcmp (toc[i].name, name) == 0)
+		return;
+	e = &toc[i];
+	e->setnr = setnr;
+	e->file = file;
+	e->block = block;
+	e->image = image;
+	strncpy (e->name, name, sizeof (e->name) - 1);
+	e->name[sizeof (e->name) - 1] = '\0';
+	toc_changed = 1;
+}
+
+/* What we had is not right for this tape after all.  */
+void toc_forget (void)
+{
+	toc_count = 0;
+	toc_changed = 1;
+	if (toc_path != NULL)
+		remove (toc_path);
+}
+
+/* Write the table of contents back, if we learned anything.  */
+void toc_save (void)
+{
+	char *tmp;
+	FILE *f;
+	int i;
+
+	if (toc_path == NULL || !toc_changed)
+		return;
+	mkdir (toc_dir (), 0777);
+	tmp = malloc (strlen (toc_path) + 5);
+	if (tmp == NULL)
+		return;
+	sprintf (tmp, "%s.new", toc_path);
+	if ((f = fopen (tmp, "w")) == NULL) {
+#ifdef DEBUG
+		if (debugflag)
+			perror (tmp);
+#endif
+		free (tmp);
+		return;
+	}
+	fprintf (f, "# saveset tape-file block medium name\n");
+	for (i = 0; i < toc_count; i++)
+		fprintf (f, "%d %d %ld %s %s\n", toc[i].setnr, toc[i].file,
+			 toc[i].block, toc[i].image ? "image" : "tape",
+			 toc[i].name);
+	if (fclose (f) == 0)
+		rename (tmp, toc_path);
+	else
+		remove (tmp);
+	free (tmp);
+	toc_changed = 0;
+}
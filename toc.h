@@ -0,0 +1,7 @@
+/* Tables of contents of tapes, see toc.c.  */
+
+void toc_load (char *volume);
+int toc_find (int setnr, int image, int *file, long *block);
+void toc_note (int setnr, char *name, int file, long block, int image);
+void toc_forget (void);
+void toc_save (void);
@@ -0,0 +1,177 @@
+/*
+ *  Minimal io_uring support, talking to the kernel directly so that we
+ *  do not need liburing.  Only what vmsbackup uses is here: set up a
+ *  ring, fill in submission entries, submit them and reap completions.
+ *  Linux only; compiled in with HAVE_IO_URING.
+ */
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+	return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter (int fd, unsigned to_submit,
+			       unsigned min_complete, unsigned flags)
+{
+	return syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+}
+
+/* Set up U with room for ENTRIES submissions.  Returns 0, or -1 with
+   errno set if the kernel does not let us have a ring.  */
+int uring_init (struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset (u, 0, sizeof (*u));
+	memset (&p, 0, sizeof (p));
+	u->fd = sys_io_uring_setup (entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	u->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof (struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	sq = mmap (NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	u->sq_ring = sq;
+	cq = mmap (NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+		goto fail;
+	u->cq_ring = cq;
+	u->sqes = mmap (NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->sq_local = *u->sq_tail;
+	return 0;
+
+  fail:
+	uring_exit (u);
+	return -1;
+}
+
+void uring_exit (struct uring *u)
+{
+	if (u->sqes != NULL)
+		munmap (u->sqes, u->sqes_size);
+	if (u->cq_ring != NULL)
+		munmap (u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring != NULL)
+		munmap (u->sq_ring, u->sq_ring_size);
+	if (u->fd >= 0)
+		close (u->fd);
+	memset (u, 0, sizeof (*u));
+	u->fd = -1;
+}
+
+/* Register LEN bytes at BUF as fixed buffer 0.  */
+int uring_register_buffer (struct uring *u, void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return syscall (__NR_io_uring_register, u->fd,
+			IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+/* Register a table of N direct descriptors, all of them empty, for
+   operations that open files into it.  */
+int uring_register_files (struct uring *u, unsigned n)
+{
+	int *fds;
+	int ret;
+
+	fds = malloc (n * sizeof (int));
+	if (fds == NULL)
+		return -1;
+	memset (fds, 0xff, n * sizeof (int));	/* all -1 */
+	ret = syscall (__NR_io_uring_register, u->fd,
+		       IORING_REGISTER_FILES, fds, n);
+	free (fds);
+	return ret;
+}
+
+/* Get a cleared submission entry, or NULL if the ring is full.  The entry
+   goes to the kernel with the next uring_submit.  */
+struct io_uring_sqe *uring_sqe (struct uring *u)
+{
+	unsigned head = __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (u->sq_local - head >= u->sq_entries)
+		return NULL;
+	idx = u->sq_local & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset (sqe, 0, sizeof (*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local++;
+	return sqe;
+}
+
+/* Pass everything queued with uring_sqe to the kernel and wait until at
+   least WAIT completions are available.  Returns the number submitted,
+   or -1 with errno set.  */
+int uring_submit (struct uring *u, unsigned wait)
+{
+	unsigned n = u->sq_local - *u->sq_tail;
+	int ret;
+
+	__atomic_store_n (u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+	do
+		ret = sys_io_uring_enter (u->fd, n, wait,
+					  wait ? IORING_ENTER_GETEVENTS : 0);
+	while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+/* The oldest unseen completion, or NULL if there is none.  */
+struct io_uring_cqe *uring_peek (struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+/* Done with the completion uring_peek returned.  */
+void uring_seen (struct uring *u)
+{
+	__atomic_store_n (u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* HAVE_IO_URING */
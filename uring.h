@@ -0,0 +1,27 @@
+/* Minimal io_uring support, see uring.c.  */
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int	fd;
+	void	*sq_ring, *cq_ring;
+	size_t	sq_ring_size, cq_ring_size, sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries;
+	/* Our copy of the tail, ahead of *SQ_TAIL until uring_submit.  */
+	unsigned sq_local;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+int uring_init (struct uring *u, unsigned entries);
+void uring_exit (struct uring *u);
+int uring_register_buffer (struct uring *u, void *buf, size_t len);
+int uring_register_files (struct uring *u, unsigned n);
+struct io_uring_sqe *uring_sqe (struct uring *u);
+int uring_submit (struct uring *u, unsigned wait);
+struct io_uring_cqe *uring_peek (struct uring *u);
+void uring_seen (struct uring *u);
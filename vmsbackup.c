@@ -27,13 +27,6 @@
  *
  */
 
-/* Does this system have the magnetic tape ioctls?  The answer is yes for 
-   most/all unices, and I think it is yes for VMS 7.x with DECC 5.2 (needs
-   verification), but it is no for VMS 6.2.  */
-#ifndef HAVE_MT_IOCTLS
-#define HAVE_MT_IOCTLS 1
-#endif
-
 #ifdef HAVE_UNIXIO_H
 /* Declarations for read, write, etc.  */
 #include <unixio.h>
@@ -47,31 +40,25 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <sys/types.h>
-#if HAVE_MT_IOCTLS
-#include <sys/ioctl.h>
-#include <sys/mtio.h>
-#endif
-#ifdef REMOTE
-#include <local/rmt.h>
-#include <sys/stat.h>
-#endif
 #include <sys/file.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "fabdef.h"
 
-#ifndef __vax
-/* The help claims that mkdir is declared in stdlib.h but it doesn't
-   seem to be true.  AXP/VMS 6.2, DECC ?.?.  On the other hand, VAX/VMS 6.2
-   seems to declare it in a way which conflicts with this definition.
-   This is starting to sound like a bad dream.  */
-int mkdir (char *path, int mode);
-#endif
-
 #include "vmsbackup.h"
 #include "match.h"
 #include "sysdep.h"
+#include "tapeio.h"
+#include "toc.h"
+#include "xlate.h"
+#include "crc.h"
+#include "outfile.h"
 
 #ifdef DEBUG
 #include "hexdump.h"
@@ -172,6 +159,20 @@ unsigned int getu16 (unsigned char *addr)
 	return ((unsigned int)addr[1] << 8) | addr[0];
 }
 
+static void putu32 (unsigned long u, unsigned char *addr)
+{
+	addr[0] = u;
+	addr[1] = u >> 8;
+	addr[2] = u >> 16;
+	addr[3] = u >> 24;
+}
+
+static void putu16 (unsigned int u, unsigned char *addr)
+{
+	addr[0] = u;
+	addr[1] = u >> 8;
+}
+
 struct bbh {
 	unsigned char	bbh_dol_w_size[2];
 	unsigned char	bbh_dol_w_opsys[2];
@@ -241,7 +242,7 @@ int	afilesize;
 char	recfmt;		/* record format */
 char	recatt;		/* record attributes */
 
-FILE	*f	= NULL;
+OUTFILE	*f	= NULL;
 
 /* Number of bytes we have read from the current file so far (or something
    like that; see process_vbn).  */
@@ -252,6 +253,17 @@ short	fix;
 short	recsize;
 int	vfcsize;
 
+/* How the carriage control of the current file is handled: written as
+   it is, or turned into newlines and form feeds (see carriage).  */
+enum { CC_NONE, CC_FTN, CC_PRN };
+int	cc_mode;
+/* Whether the text of the current file goes through to_utf8.  */
+int	file_utf8;
+/* Whether the data of the current file is written just as it is in
+   its VBN records: fixed length records, undefined (which we used to
+   reject), and stream files with -B.  */
+int	file_verbatim;
+
 /* Number of files we have seen.  */
 unsigned int nfiles;
 /* Number of blocks in those files.  */
@@ -261,7 +273,6 @@ unsigned long nblocks;
 FILE	*lf;
 #endif
 
-int	fd;		/* tape file descriptor */
 
 /* Command line stuff.  */
 
@@ -289,6 +300,52 @@ int flag_full;
 /* Which save set are we reading?  */
 int	selset;
 
+/* Size of the read-ahead buffer (--buffer), or 0 to read the tape only
+   as we need it.  FLAG_BUFFER_LOCK asks for it to be locked in memory,
+   FLAG_BUFFER_HUGE for it to use huge pages.  */
+long	tape_buffer;
+int	flag_buffer_lock, flag_buffer_huge;
+
+/* Number of reads to keep in flight with io_uring (--io-uring), or 0 to
+   read savesets on disk the ordinary way.  */
+int	uring_depth;
+
+/* Number of threads to use for decompressing the saveset and for
+   decoding its blocks (-j), or 0 for one per processor.  */
+int	nthreads;
+
+/* SIMH tape image to copy the whole tape to (--image-to), or NULL.  */
+char	*image_file;
+
+/* Character set to convert text files from to UTF-8 (--to-utf8),
+   XLATE_MCS or XLATE_LATIN1, or 0 to leave them as they are.  */
+int	to_utf8;
+
+/* Nonzero to check the CRC and header checksum of each block
+   (--verify-crc).  */
+int	verify_crc;
+
+/* How many blocks failed those checks and were used all the same.  */
+static unsigned long crc_errors;
+
+/* Nonzero to carry on after a damaged block (--salvage).  */
+int	salvage;
+
+/* How many damaged blocks were skipped or cut short.  */
+static unsigned long salv_damage;
+
+/* Size of the buffer the files being extracted are written from
+   (--write-buffer), or 0 for the default.  */
+long	write_buffer;
+
+/* Nonzero to leave holes where extracted files are all zeros
+   (--sparse).  */
+int	sparse;
+
+/* Number of small files to have on their way at once through io_uring
+   (--uring-files), or 0 to write each one before going on.  */
+int	uring_files;
+
 /* These variables describe the files we will be operating on.  GARGV is
    a vector of GARGC elements, and the elements from GOPTIND to the end
    are the names.  */
@@ -300,21 +357,18 @@ int	setnr;
 #define	LABEL_SIZE	80
 char	label[LABEL_SIZE];
 
+/* The block being processed; it belongs to tapeio.c.  */
 unsigned char	*block;
 /* Default blocksize, as specified in -b option.  */
 int	blocksize = 32256;
 
-#if HAVE_MT_IOCTLS
-struct	mtop	op;
-#endif
-
 static int typecmp(char *str);
 
-FILE *openfile(char *fn)
+OUTFILE *openfile(char *fn)
 {
 	char	ufn[256];
 	char	ans[80];
-	char	*p, *q, s, *ext;
+	char	*p, *q, *ext;
 	int	procf;
 
 	procf = 1;
@@ -335,13 +389,13 @@ FILE *openfile(char *fn)
 	p = ufn;
 	q = ++p;
 	while (*q) {
-		if (*q == '.' || *q == ']') {
-			s = *q;
+		if (*q == '.')
+			*q = '/';
+		else if (*q == ']') {
 			*q = '\0';
-			if(procf && dflag) mkdir(p, 0777);
+			if(procf && dflag) out_mkdir(p);
 			*q = '/';
-			if (s == ']')
-				break;
+			break;
 		}
 		q++;
 	}
@@ -367,7 +421,7 @@ FILE *openfile(char *fn)
 	}
 	if(procf)
 		/* open the file for writing */
-		return(fopen(p, "w"));
+		return(out_open(p, filesize));
 	else
 		return(NULL);
 }
@@ -437,23 +491,15 @@ void process_summary (unsigned char *buffer, size_t rsize)
 
 	if (!tflag)
 		return;
-	/* check the header word */
-	if (buffer[0] != 1 || buffer[1] != 1) {
-		printf ("Cannot print summary; invalid data header\n");
-		return;
-	}
+	/* check_attrs has been through the attributes already */
 	c = 2;
-	while (c < rsize) {
+	while (c + 4 <= rsize) {
 #ifdef DEBUG
 	    if (debugflag) {
-		hexdump(buffer + c, 16, stdout);
+		hexdump(buffer + c, rsize - c < 16 ? rsize - c : 16, stdout);
 	    }
 #endif
 		dsize = getu16 ((unsigned char *)((struct bsa *)&buffer[c])->bsa_dol_w_size);
-	        if (dsize < 0) {
-		    fprintf(stderr, "Corrupted backup file, size is negative\n");
-		    return;
-		}
 
 		type = getu16 ((unsigned char *)((struct bsa *)&buffer[c])->bsa_dol_w_type);
 		text = (unsigned char *)((struct bsa *)&buffer[c])->bsa_dol_t_text;
@@ -585,23 +631,161 @@ void process_summary (unsigned char *buffer, size_t rsize)
 	   and the list of files that follows.  */
 }
 
+/* Whether a file with record format FMT and attributes ATT holds text.  */
+static int text_file(int fmt, int att)
+{
+	return fmt == FAB$C_STM || fmt == FAB$C_STMLF || fmt == FAB$C_STMCR
+		|| (att & (FAB$M_FTN | FAB$M_CR | FAB$M_PRN));
+}
+
+/* Write N bytes of text to the file being extracted, in UTF-8 if that
+   was asked for.  Most text is plain ASCII and is written as it is.  */
+static void put_text(const unsigned char *p, int n)
+{
+	static unsigned char ubuf[2 * 65536];
+
+	if (file_utf8 && xlate_ascii(p, n) < n) {
+		n = xlate_utf8(ubuf, p, n, to_utf8);
+		p = ubuf;
+	}
+	out_write(f, p, n);
+}
+
+/*
+ *  Carriage control.  A print file record (FAB$M_PRN) has two bytes of
+ *  VFC in front of it, saying what to do to the printer before and after
+ *  the record; a FORTRAN carriage control character (FAB$M_FTN) stands
+ *  for one such pair, and ftn_pre and ftn_post give it.  Each byte is
+ *	0		nothing
+ *	0x01-0x7f	that many newlines
+ *	0x80-0x9f	the control character in the low five bits
+ *	0xa0-0xff	device specific; nothing
+ *  A carriage return after a record does not end the line yet, since what
+ *  comes next usually does that; so we keep track of where on the line we
+ *  are, and the record text is written with one fwrite.
+ */
+static enum { LINE_START, LINE_OPEN, LINE_CR, LINE_NEW } cc_line;
+static unsigned char ftn_pre[256], ftn_post[256];
+/* The control bytes of the record being written.  */
+static unsigned char vfc[2], cc_post;
+static int vfc_left, ftn_pending;
+
+static void cc_start(void)
+{
+	int c;
+
+	if (ftn_post[' '] == 0)
+		for (c = 0; c < 256; c++) {
+			switch (c) {
+			case 0:	  ftn_pre[c] = 0;    ftn_post[c] = 0;    break;
+			case '0': ftn_pre[c] = 2;    ftn_post[c] = 0x8d; break;
+			case '1': ftn_pre[c] = 0x8c; ftn_post[c] = 0x8d; break;
+			case '+': ftn_pre[c] = 0;    ftn_post[c] = 0x8d; break;
+			case '$': ftn_pre[c] = 1;    ftn_post[c] = 0;    break;
+			default:  ftn_pre[c] = 1;    ftn_post[c] = 0x8d; break;
+			}
+		}
+	cc_line = LINE_START;
+	vfc_left = ftn_pending = 0;
+}
+
+static void carriage(int c)
+{
+	int n;
+
+	if (c == 0 || c >= 0xa0)
+		return;
+	if (c < 0x80) {
+		/* a newline at the very start would only be a blank line */
+		n = cc_line == LINE_START ? c - 1 : c;
+		while (n-- > 0)
+			out_putc('\n', f);
+		cc_line = LINE_NEW;
+		return;
+	}
+	c &= 0x1f;
+	if (c == '\r') {
+		if (cc_line == LINE_OPEN)
+			cc_line = LINE_CR;
+		return;
+	}
+	if (c == '\n' || c == '\f' || c == '\v') {
+		if (cc_line == LINE_OPEN || cc_line == LINE_CR)
+			out_putc('\n', f);
+		cc_line = LINE_NEW;
+		if (c == '\n')
+			return;
+	}
+	out_putc(c, f);
+}
+
+static void cc_text(unsigned char *p, int n)
+{
+	if (n == 0)
+		return;
+	if (cc_line == LINE_CR)
+		out_putc('\r', f);	/* overprinting */
+	put_text(p, n);
+	cc_line = LINE_OPEN;
+}
+
+/* The end of the file ends its last line.  */
+static void cc_end(void)
+{
+	if (cc_line == LINE_OPEN || cc_line == LINE_CR)
+		out_putc('\n', f);
+	cc_line = LINE_NEW;
+}
+
+/* The types of the attribute records at the start of a file that we
+   use.  */
+#define ATR_FILENAME	0x2a
+#define ATR_FILEID	0x2c
+#define ATR_UIC		0x2f
+#define ATR_PROTECTION	0x30
+#define ATR_RECORD	0x34
+#define ATR_CREATED	0x36
+#define ATR_REVISED	0x37
+#define ATR_EXPIRES	0x38
+#define ATR_BACKUP	0x39
+#define ATR_MAX		0x58
+
+/* Where each attribute record of the current file is, by type, or NULL
+   if it has none of that type.  process_file only notes where they are,
+   and they are decoded when they are needed; most of them only are for
+   a full listing.  */
+static unsigned char *attr_data[ATR_MAX];
+static unsigned short attr_size[ATR_MAX];
+
+/* Put the date in attribute record DTYPE into BUF (32 bytes), the way
+   BACKUP/LIST shows it.  */
+static char *attr_date(int dtype, char *buf)
+{
+	unsigned char *data = attr_data[dtype];
+	short len;
+
+	strcpy (buf, " <None specified>");
+	if (data == NULL || memcmp("\0\0\0\0\0\0\0\0", data, 8) == 0)
+		return buf;
+	if (!(time_vms_to_asc (&len, buf, data, 8) & 1))
+		strcpy (buf, "error converting date");
+	return buf;
+}
+
 void process_file(unsigned char *buffer, size_t rsize)
 {
 	int	i;
 	unsigned char *p;
         char *q;
-	long nblk;
-	long ablk;
-	short	dsize, lnch;
+	long nblk = 0;
+	long ablk = 0;
+	unsigned short	dsize;
+	short	lnch = 0;
 	short dtype;
 	unsigned char *data;
 	char *cfname;
 	char *sfilename;
-	char date1[32] = " <None specified>";
-	char date2[32] = " <None specified>";
-	char date3[32] = " <None specified>";
-	char date4[32] = " <None specified>";
-	short date_length = 0;
+	char date[32];
 	unsigned int fileid1 = 0, fileid2 = 0, fileid3 = 0;
 	unsigned int extension = 0;
 	unsigned int protection = 0;
@@ -623,13 +807,10 @@ void process_file(unsigned char *buffer, size_t rsize)
     if (debugflag)
 	    printf("process_file, expecting %ld bytes\n", rsize);
 #endif
-	/* check the header word */
-	if (buffer[0] != 1 || buffer[1] != 1) {
-		printf("Snark: invalid data header in process_file: %02x %02x\n", buffer[0], buffer[1]);
-		exit(EXIT_FAILURE);
-	}
+	/* check_attrs has been through the attributes already */
 	c = 2;
-	while (c < rsize) {
+	memset(attr_data, 0, sizeof (attr_data));
+	while (c + 4 <= rsize) {
 		dsize = getu16 ((unsigned char *)((struct bsa *) &buffer[c])->bsa_dol_w_size);
 		dtype = getu16 ((unsigned char *)((struct bsa *)&buffer[c])->bsa_dol_w_type);
 		data = (unsigned char *)((struct bsa *)&buffer[c])->bsa_dol_t_text;
@@ -638,160 +819,54 @@ void process_file(unsigned char *buffer, size_t rsize)
 		debug_dump(data, dsize, dtype, dtype_names, sizeof(dtype_names)/sizeof(char *));
 #endif
 
-		/* Probably should define constants for the cases in this
-		   switch, but I don't know anything about whether they
-		   have "official" names we should be using or anything
-		   like that.  */
-		switch (dtype) {
-		case 0x2a:
-			/* Copy the text into filename, and '\0'-terminate
-			   it.  */
-			p = data;
-			q = filename;
-			for (i = 0;
-			     i < dsize && q < filename + sizeof (filename) - 1;
-			     i++)
-				*q++ = *p++;
-			*q = '\0';
-			break;
-		case 0x2b:
-			/* In my example, two bytes, 0x1 0x2.  */
-			break;
-		case 0x2c:
-			/* In my example, 6 bytes,
-			   0x7a 0x2 0x57 0x0 0x1 0x1.  */
-			fileid1 = getu16(data);
-			fileid2 = getu16(data + 2);
-			fileid3 = getu16(data + 4);
-			break;
-		case 0x2e:
-			/* In my example, 4 bytes, 0x00000004.  Maybe
-			   the allocation.  */
-			break;
-		case 0x2f:
-			if (dsize == 4) {
-				usr = getu16 (data);
-				grp = getu16 (data + 2);
-			}
-			break;
-		case 0x34:
-			recfmt = data[0];
-			recatt = data[1];
-			recsize = getu16 (&data[2]);
-			/* bytes 4-7 unaccounted for.  */
-			ablk = getu16 (&data[6]);
-			nblk = getu16 (&data[10])
-				/* Adding in the following amount is a
-				   change that I brought over from
-				   vmsbackup 3.1.  The comment there
-				   said "subject to confirmation from
-				   backup expert here" but I'll put it
-				   in until someone complains.  */
-				+ (64 * 1024) * getu16 (&data[8]);
-			lnch = getu16 (&data[12]);
-			/* byte 14 unaccounted for */
-			vfcsize = data[15];
-			if (vfcsize == 0)
-				vfcsize = 2;
-			/* bytes 16-31 unaccounted for */
-			extension = getu16 (&data[18]);
-			break;
-		case 0x2d:
-			/* In my example, 6 bytes.  hex 2b3c 2000 0000.  */
-			break;
-		case 0x30:
-			/* In my example, 2 bytes.  0x44 0xee.  */
-			protection = getu16 (&data[0]);
-			break;
-		case 0x31:
-			/* In my example, 2 bytes.  hex 0000.  */
-			break;
-		case 0x32:
-			/* In my example, 1 byte.  hex 00.  */
-			break;
-		case 0x33:
-			/* In my example, 4 bytes.  hex 00 0000 00.  */
-			break;
-		case 0x4b:
-			/* In my example, 2 bytes.  Hex 01 00.  */
-			break;
-		case 0x50:
-			/* In my example, 1 byte.  hex 00.  */
-			break;
-		case 0x57:
-			/* In my example, 1 byte.  hex 00.  */
-			break;
-		case 0x4f:
-			/* In my example, 4 bytes.  05 0000 00.  */
-			break;
-		case 0x35:
-			/* In my example, 2 bytes.  04 00.  */
-			/* reviseno = getu16 ((char *)&data[0]); ! unused */
-			break;
-		case 0x36:
-			/* In my example, 8 bytes.  Presumably a date.  */
-			if (memcmp("\0\0\0\0\0\0\0\0", data, 8) != 0 &&
-				!(time_vms_to_asc (&date_length, date4, data, 8)
-				 & 1))
-			{
-				strcpy (date4, "error converting date");
-			}
-		        else if (debugflag)
-			    printf("%s\n", date1);
-			break;
-		case 0x37:
-			/* In my example, 8 bytes.  Presumably a date.  */
-			if (memcmp("\0\0\0\0\0\0\0\0", data, 8) != 0 &&
-				!(time_vms_to_asc (&date_length, date1, data, 8)
-				 & 1))
-			{
-				strcpy (date1, "error converting date");
-			}
-		        else if (debugflag)
-			    printf("%s\n", date1);
-			break;
-		case 0x38:
-			/* In my example, 8 bytes.  Presumably expires
-			   date, since my examples has all zeroes here
-			   and BACKUP prints "<None specified>" for
-			   expires.  */
-			if (memcmp("\0\0\0\0\0\0\0\0", data, 8) != 0 &&
-				!(time_vms_to_asc (&date_length, date2, data, 8)
-				 & 1))
-			{
-				strcpy (date2, "error converting date");
-			}
-		        else if (debugflag)
-			    printf("%s\n", date2);
-			break;
-		case 0x39:
-			/* In my example, 8 bytes.  Presumably a date.  */
-			if (memcmp("\0\0\0\0\0\0\0\0", data, 8) != 0 &&
-				!(time_vms_to_asc (&date_length, date3, data, 8)
-				 & 1))
-			{
-				strcpy (date3, "error converting date");
-			}
-		        else if (debugflag)
-			    printf("%s\n", date3);
-			break;
-		case 0x47:
-			/* In my example, 4 bytes.  01 00c6 00.  */
-			break;
-		case 0x48:
-			/* In my example, 2 bytes.  88 aa.  */
-			break;
-		case 0x4a:
-			/* In my example, 2 bytes.  01 00.  */
-			break;
-			/* then comes 0x0, offset 0x2b7.  */
+		if (dtype >= 0 && dtype < ATR_MAX) {
+			attr_data[dtype] = data;
+			attr_size[dtype] = dsize;
 		}
 		c += dsize + 4;
 	}
 
+	/* Only what every run needs is decoded here; the rest waits until
+	   the listing asks for it.  */
+	if ((data = attr_data[ATR_FILENAME]) != NULL) {
+		/* Copy the text into filename, and '\0'-terminate it.  */
+		dsize = attr_size[ATR_FILENAME];
+		p = data;
+		q = filename;
+		for (i = 0;
+		     i < dsize && q < filename + sizeof (filename) - 1;
+		     i++)
+			*q++ = *p++;
+		*q = '\0';
+	}
+	if ((data = attr_data[ATR_RECORD]) != NULL) {
+		recfmt = data[0];
+		recatt = data[1];
+		recsize = getu16 (&data[2]);
+		/* bytes 4-7 unaccounted for.  */
+		ablk = getu16 (&data[6]);
+		nblk = getu16 (&data[10])
+			/* Adding in the following amount is a change that I
+			   brought over from vmsbackup 3.1.  The comment
+			   there said "subject to confirmation from backup
+			   expert here" but I'll put it in until someone
+			   complains.  */
+			+ (64 * 1024) * getu16 (&data[8]);
+		lnch = getu16 (&data[12]);
+		/* byte 14 unaccounted for */
+		vfcsize = data[15];
+		if (vfcsize == 0)
+			vfcsize = 2;
+		/* bytes 16-31 unaccounted for */
+	}
+
 #ifdef	DEBUG
 	if (debugflag)
 	{
+		printf("%s\n", attr_date(ATR_CREATED, date));
+		printf("%s\n", attr_date(ATR_REVISED, date));
+		printf("%s\n", attr_date(ATR_EXPIRES, date));
+		printf("%s\n", attr_date(ATR_BACKUP, date));
 		printf("recfmt = %d\n", recfmt);
 		printf("recatt = %d\n", recatt);
 		printf("reclen = %d\n", recsize);
@@ -814,7 +889,8 @@ void process_file(unsigned char *buffer, size_t rsize)
 
 	/* open the file */
 	if (f != NULL) {
-		fclose(f);
+		out_close(f);
+		f = NULL;
 		file_count = 0;
 		reclen = 0;
 	}
@@ -853,9 +929,24 @@ void process_file(unsigned char *buffer, size_t rsize)
 	else
 		procf = 1;
 	if (tflag && procf && !flag_full)
-	    printf ("%-52s %8ld  %s\n", filename, blocks, date4);
+	    printf ("%-52s %8ld  %s\n", filename, blocks,
+		    attr_date(ATR_CREATED, date));
 
 	if (tflag && procf && flag_full) {
+		if ((data = attr_data[ATR_FILEID]) != NULL) {
+			fileid1 = getu16(data);
+			fileid2 = getu16(data + 2);
+			fileid3 = getu16(data + 4);
+		}
+		if ((data = attr_data[ATR_UIC]) != NULL
+		    && attr_size[ATR_UIC] == 4) {
+			usr = getu16 (data);
+			grp = getu16 (data + 2);
+		}
+		if ((data = attr_data[ATR_PROTECTION]) != NULL)
+			protection = getu16 (&data[0]);
+		if ((data = attr_data[ATR_RECORD]) != NULL)
+			extension = getu16 (&data[18]);
 		printf ("%-30.30s File ID:  (%d,%d,%d)\n",
 			filename,fileid1,fileid2,fileid3);
 		printf ("  Size:       %6ld/%-6ld    Owner:    [%06o,%06o]\n",
@@ -888,10 +979,11 @@ void process_file(unsigned char *buffer, size_t rsize)
 		printf(")\n");
 
 #ifdef HAVE_STARLET
-		printf("  Created:  %s\n", date4);
-		printf("  Revised:  %s (%u)\n", date1, reviseno);
-		printf("  Expires:  %s\n", date2);
-		printf("  Backup:   %s\n", date3);
+		printf("  Created:  %s\n", attr_date(ATR_CREATED, date));
+		printf("  Revised:  %s (%u)\n", attr_date(ATR_REVISED, date),
+		       reviseno);
+		printf("  Expires:  %s\n", attr_date(ATR_EXPIRES, date));
+		printf("  Backup:   %s\n", attr_date(ATR_BACKUP, date));
 #endif
 
 		printf ("  File Organization:  ");
@@ -942,6 +1034,21 @@ void process_file(unsigned char *buffer, size_t rsize)
 		/* open file */
 		f = openfile(filename);
 		if(f != NULL && vflag) printf("extracting %s\n", filename);
+		cc_mode = CC_NONE;
+		if (!flag_binary && (recfmt == FAB$C_VAR || recfmt == FAB$C_VFC)) {
+			if (recatt & FAB$M_FTN)
+				cc_mode = CC_FTN;
+			else if (recfmt == FAB$C_VFC && (recatt & FAB$M_PRN))
+				cc_mode = CC_PRN;
+		}
+		file_utf8 = to_utf8 && !flag_binary
+			&& text_file(recfmt, recatt);
+		file_verbatim = !file_utf8
+			&& (recfmt == FAB$C_FIX || recfmt == FAB$C_UDF
+			    || (flag_binary && (recfmt == FAB$C_STM
+						|| recfmt == FAB$C_STMLF
+						|| recfmt == FAB$C_STMCR)));
+		cc_start();
 	}
 	++nfiles;
 	nblocks += blocks;
@@ -952,29 +1059,112 @@ void process_file(unsigned char *buffer, size_t rsize)
  *  process a virtual block record (file record)
  *
  */
+/* A record of a block, as found by parse_block.  */
+struct prec {
+	unsigned short	type, size;
+	unsigned char	*data;
+	/* For a VBN record of a stream file, the first CONV_N bytes of it
+	   already converted as CONV_HOW says, into CONV_LEN bytes at CONV;
+	   CONV_N is 0 if that has not been done.  */
+	unsigned char	*conv;
+	int		conv_how, conv_n, conv_len;
+	/* Nonzero if a summary or file record is not to be trusted.  */
+	int		bad;
+};
+
+#define CONV_CRLF	1
+#define CONV_UTF8	2
+
+/* The VBN record being processed, if its text has been converted
+   already (see the batch code below).  */
+static struct prec *vbn_conv;
+
+/* Write the converted text of the VBN record being processed, if we have
+   it for the N bytes from I on.  Returns 1 if so.  */
+static int put_conv(int i, int n)
+{
+	if (vbn_conv == NULL || i != 0 || n != vbn_conv->conv_n)
+		return 0;
+	out_write(f, vbn_conv->conv, vbn_conv->conv_len);
+	return 1;
+}
+
+/* Write N bytes of a file that is extracted as it is.  From a saveset
+   on disk they are copied from there by the kernel if it can.  */
+static void put_data(const unsigned char *p, int n)
+{
+	long off = tape_offset(p);
+	size_t k = 0;
+
+	if (off >= 0)
+		k = out_copy(f, fd, off, n);
+	if (k < n)
+		out_write(f, p + k, n - k);
+}
+
+/* Count down *RECLEN over N bytes the way process_vbn used to, one byte
+   at a time: when it reaches 0 it starts again at RESET, and since it is
+   a short, a count that has gone negative runs on until it wraps round
+   to 0.  A RESET of 0 does the same as a negative count.  */
+static void count_records(short *reclenp, int reset, int n)
+{
+	unsigned short r;
+
+	while (n > 0) {
+		if (*reclenp == 0)
+			*reclenp = reset;
+		r = *reclenp;
+		if (r == 0 || r > n) {
+			*reclenp -= n;
+			return;
+		}
+		n -= r;
+		*reclenp = 0;
+	}
+}
+
+/* Write the data of a VBN record.  Rather than handling a byte at a
+   time, each pass through the loop works out the longest run that needs
+   nothing but copying (the rest of the record for FIX and VAR, all of
+   it for stream files, with carriage returns translated for Stream_CR)
+   and writes it with one out_write; RECLEN, FIX and FILE_COUNT carry the
+   record state over to the next VBN record.  */
 void process_vbn(unsigned char *buffer, unsigned short rsize)
 {
-	int	c, i;
-	int j;
+	static unsigned char crbuf[65536];
+	const unsigned char *p;
+	int	i, n;
 
 	if (f == NULL) {
 		return;
 	}
+	if (file_verbatim) {
+		/* No record structure or text to look at.  */
+		n = rsize;
+		if (n > filesize - file_count)
+			n = filesize - file_count;
+		if (n > 0) {
+			put_data(buffer, n);
+			file_count += n;
+		}
+		return;
+	}
 	i = 0;
 	while (file_count+i < filesize && i < rsize) {
+		/* what is left of this record and of the file */
+		n = rsize - i;
+		if (n > filesize - (file_count+i))
+			n = filesize - (file_count+i);
 		switch (recfmt) {
 		case FAB$C_FIX:
-			if (reclen == 0) {
-				reclen = recsize;
-			}
-			fputc(buffer[i], f);
-			i++;
-			reclen--;
+			count_records(&reclen, recsize, n);
+			put_text(buffer+i, n);
+			i += n;
 			break;
 
 		case FAB$C_VAR:
 		case FAB$C_VFC:
-			if (reclen == 0) {
+			if (reclen == 0 && vfc_left == 0) {
 				reclen = getu16 (&buffer[i]);
 #ifdef	NEWD
 				fprintf(lf, "---\n");
@@ -983,38 +1173,63 @@ void process_vbn(unsigned char *buffer, unsigned short rsize)
 				fprintf(lf, "rsize = 0x%x/%d\n", rsize, rsize);
 #endif
 				fix = reclen;
-				if (flag_binary) for (j = 0; j < 2; j++) {
-					fputc (buffer[i+j], f);
-				}
+				if (flag_binary)
+					out_write(f, buffer+i, 2);
 				i += 2;
 				if (recfmt == FAB$C_VFC) {
-					if (flag_binary)
-						for (j = 0; j < vfcsize; j++) {
-							fputc (buffer[i+j], f);
-						}
-					i += vfcsize;
+					vfc_left = vfcsize;
+					vfc[1] = 0;
 					reclen -= vfcsize;
 				}
-			} else if (reclen == fix
-					&& recatt == FAB$M_FTN) {
-					/****
-					if (buffer[i] == '0')
-						fputc('\n', f);
-					else if (buffer[i] == '1')
-						fputc('\f', f);
-					*** sow ***/
-					fputc(buffer[i],f); /** sow **/
+				ftn_pending = cc_mode == CC_FTN;
+			} else if (vfc_left > 0) {
+				/* The fixed control area, which can run over into
+				   the next VBN.  */
+				if (n > vfc_left)
+					n = vfc_left;
+				if (flag_binary)
+					out_write(f, buffer+i, n);
+				while (n-- > 0) {
+					if (vfcsize - vfc_left < sizeof (vfc))
+						vfc[vfcsize - vfc_left] = buffer[i];
 					i++;
-					reclen--;
+					vfc_left--;
+				}
+				if (vfc_left == 0 && cc_mode == CC_PRN) {
+					carriage(vfc[0]);
+					cc_post = vfc[1];
+				}
 			} else {
-				fputc(buffer[i], f);
-				i++;
-				reclen--;
+				if (ftn_pending) {
+					carriage(ftn_pre[buffer[i]]);
+					cc_post = ftn_post[buffer[i]];
+					ftn_pending = 0;
+					i++;
+					reclen--;
+					n--;
+				}
+				if (n > (unsigned short)reclen)
+					n = (unsigned short)reclen;
+				if (cc_mode != CC_NONE)
+					cc_text(buffer+i, n);
+				else
+					put_text(buffer+i, n);
+				i += n;
+				reclen -= n;
 			}
-			if (reclen == 0) {
-				if (!flag_binary) fputc('\n', f);
+			if (reclen == 0 && vfc_left == 0) {
+				if (cc_mode != CC_NONE) {
+					if (ftn_pending) {
+						/* empty, so no control either */
+						carriage(ftn_pre[' ']);
+						cc_post = ftn_post[' '];
+						ftn_pending = 0;
+					}
+					carriage(cc_post);
+				} else if (!flag_binary)
+					out_putc('\n', f);
 				if (i & 1) {
-					if (flag_binary) fputc (buffer[i], f);
+					if (flag_binary) out_putc(buffer[i], f);
 					i++;
 				}
 			}
@@ -1025,52 +1240,297 @@ void process_vbn(unsigned char *buffer, unsigned short rsize)
 			if (reclen < 0) {
 				printf("SCREAM\n");
 			}
-			if (reclen == 0) {
-				reclen = 512;
-			}
-			c = buffer[i++];
-			reclen--;
-			if (c == '\n') {
+			/* All of it is copied; RECLEN just follows how far we
+			   are into the current line, in pieces of 512 bytes.  */
+			p = xlate_last(buffer+i, n, '\n');
+			if (p != NULL) {
 				reclen = 0;
-			}
-			fputc(c, f);
+				count_records(&reclen, 512, buffer+i+n - (p+1));
+			} else
+				count_records(&reclen, 512, n);
+			if (!put_conv(i, n))
+				put_text(buffer+i, n);
+			i += n;
 			break;
 
 		case FAB$C_STMCR:
-			c = buffer[i++];
-			if (c == '\r' && !flag_binary)
-				fputc('\n', f);
-			else
-				fputc(c, f);
+			/* carriage returns become newlines */
+			if (flag_binary)
+				out_write(f, buffer+i, n);
+			else if (!put_conv(i, n)) {
+				xlate_crlf(crbuf, buffer+i, n);
+				put_text(crbuf, n);
+			}
+			i += n;
 			break;
 
 		default:
-			fclose(f); f = NULL;
+			out_close(f); f = NULL;
 			remove(filename);
 			fprintf(stderr, "Invalid record format = %d\n", recfmt);
 			return;
 		}
 	}
 	file_count += i;
+	if (cc_mode != CC_NONE && file_count >= filesize)
+		cc_end();
 }
 
 /*
  *
  *  process a backup block of blksize bytes
  *
+ *  This is done in two steps: parse_block checks the block header and
+ *  finds the records in the block, and apply_block then acts on them in
+ *  order.  parse_block looks at nothing but the block, so that several
+ *  blocks can be parsed at the same time (see the batch code below);
+ *  whatever carries over from one block to the next is only touched by
+ *  apply_block.
+ *
  */
-void process_block(unsigned char *block, int blksize)
+
+/* What parse_block found wrong with a block.  */
+enum { PB_OK, PB_BHSIZE, PB_BSIZE, PB_RSIZE };
+
+/* What check_crc found, as bits.  */
+#define BAD_CHECKSUM	1
+#define BAD_CRC		2
+
+/* Bits in bbh_dol_l_flags.  */
+#define BBH_M_NOCRC	1	/* the CRC was not computed */
+#define BBH_M_XOR	2	/* an XOR block of a redundancy group */
+
+struct pblock {
+	unsigned char	*block;
+	int		len;
+	int		err;
+	unsigned long	bad, left;	/* the values the error is about */
+	int		nrec, arec;
+	struct prec	*rec;
+	unsigned char	*conv;		/* room for converted text */
+};
+
+/* Stop writing the current file where it is.  */
+static void cut_file(void)
+{
+	if (f != NULL) {
+		out_close(f);
+		f = NULL;
+	}
+	file_count = 0;
+	reclen = 0;
+}
+
+/* Part of the file being written is lost (--salvage).  */
+static void salvage_file(void)
+{
+	if (f != NULL)
+		fprintf(stderr, "%s: cut short\n", filename);
+	cut_file();
+}
+
+/* The file record in block BNUMBER is corrupted.  Its data is not
+   written anywhere; in particular not to the file before it.  */
+static void bad_file(unsigned long bnumber)
+{
+	fprintf(stderr, "Snark: invalid file attributes in block %lu, file skipped\n",
+		bnumber);
+	cut_file();
+}
+
+/* The least size of the attribute records of a file that we decode.  */
+static unsigned attr_minsize(int dtype)
+{
+	switch (dtype) {
+	case ATR_FILEID:	return 6;
+	case ATR_PROTECTION:	return 2;
+	case ATR_RECORD:	return 20;
+	case ATR_CREATED:
+	case ATR_REVISED:
+	case ATR_EXPIRES:
+	case ATR_BACKUP:	return 8;
+	}
+	return 0;
+}
+
+/* Is the DSIZE bytes at NAME a file name that openfile can take apart,
+   as far as it is copied into filename: no '\0', and a '.' after the
+   ']' that ends the directory.  */
+static int check_name(unsigned char *name, unsigned dsize)
+{
+	unsigned char *p;
+
+	if (dsize > sizeof (filename) - 1)
+		dsize = sizeof (filename) - 1;
+	if (memchr(name, '\0', dsize) != NULL
+	    || (p = memchr(name, ']', dsize)) == NULL)
+		return 0;
+	return memchr(p, '.', name + dsize - p) != NULL;
+}
+
+/* Check the attribute records of a summary (SUMMARY nonzero) or file
+   record of RSIZE bytes at BUFFER: the data header, that each of them
+   lies inside the record, and that those we decode are big enough.  A
+   summary ends with the first non-empty one of type 0, and up to three
+   bytes at the end are taken as padding.  A file must have a name.
+   This is all process_summary and process_file rely on.  Returns 0 if
+   something is wrong.  */
+static int check_attrs(unsigned char *buffer, size_t rsize, int summary)
 {
+	unsigned dsize, type;
+	size_t c;
+	int named = 0;
+
+	if (rsize < 2 || buffer[0] != 1 || buffer[1] != 1)
+		return 0;
+	for (c = 2; c + 4 <= rsize; c += dsize + 4) {
+		dsize = getu16 (&buffer[c]);
+		type = getu16 (&buffer[c + 2]);
+		if (c + 4 + dsize > rsize)
+			return 0;
+		if (summary) {
+			if (type == 0 && dsize > 0)
+				break;
+		} else if (dsize < attr_minsize(type))
+			return 0;
+		else if (type == ATR_FILENAME) {
+			if (!check_name(&buffer[c + 4], dsize))
+				return 0;
+			named = 1;
+		}
+	}
+	return summary || named;
+}
+
+/* The sum of the words of the header of BLOCK before its checksum.  */
+static unsigned int header_sum(unsigned char *block)
+{
+	unsigned int sum = 0;
+	int i;
 
-	unsigned short	bhsize, rsize, rtype;
+	for (i = 0; i < offsetof(struct bbh, bbh_dol_w_checksum); i += 2)
+		sum += getu16 (&block[i]);
+	return sum & 0xffff;
+}
+
+/* Check the header checksum and the CRC of the block of BLKSIZE bytes
+   at BLOCK, as far as they are there; returns BAD_CHECKSUM and BAD_CRC
+   for those that do not match.  The checksum is the sum of the other
+   words of the header.  The CRC is over the whole block, with the CRC
+   and the checksum taken as 0, since BACKUP fills them in last.  The
+   CRC instruction BACKUP computes it with leaves the result as it is,
+   while the usual CRC-32 complements it; either is taken.  */
+static int check_crc(unsigned char *block, int blksize)
+{
+	static const unsigned char zero[4];
+	struct bbh *bh = (struct bbh *) block;
+	unsigned int crc;
+	unsigned long want;
+	int i, err = 0;
+
+	if (blksize < sizeof(struct bbh))
+		return 0;
+	if (header_sum(block) != getu16 (bh->bbh_dol_w_checksum))
+		err |= BAD_CHECKSUM;
+
+	if (getu32 (bh->bbh_dol_l_flags) & BBH_M_NOCRC)
+		return err;
+	i = offsetof(struct bbh, bbh_dol_l_crc);
+	crc = crc_update (0xffffffff, block, i);
+	crc = crc_update (crc, zero, 4);
+	i += 4;
+	crc = crc_update (crc, &block[i],
+			  offsetof(struct bbh, bbh_dol_w_checksum) - i);
+	crc = crc_update (crc, zero, 2);
+	crc = crc_update (crc, &block[sizeof(struct bbh)],
+			  blksize - sizeof(struct bbh));
+	want = getu32 (bh->bbh_dol_l_crc);
+	if (want != crc && want != (~crc & 0xffffffff))
+		err |= BAD_CRC;
+	return err;
+}
+
+static void parse_block(struct pblock *pb, unsigned char *block, int blksize)
+{
+	struct bbh	*bh;
+	struct brh	*rh;
+	unsigned short	bhsize, rsize;
 	unsigned long	bsize, i;
-    unsigned long bnumber;
+	struct prec	*r;
 
-	i = 0;
+	pb->block = block;
+	pb->len = blksize;
+	pb->err = PB_OK;
+	pb->nrec = 0;
 
 	/* read the backup block header */
-	block_header = (struct bbh *) &block[i];
-	i += sizeof(struct bbh);
+	bh = (struct bbh *) block;
+	i = sizeof(struct bbh);
+	bhsize = getu16 ((unsigned char *)bh->bbh_dol_w_size);
+	bsize = getu32 ((unsigned char *)bh->bbh_dol_l_blocksize);
+
+	/* check the validity of the header block */
+	if (bhsize != sizeof(struct bbh)) {
+		pb->err = PB_BHSIZE;
+		pb->bad = bhsize;
+		return;
+	}
+	/* probe_blocksize has made sure this agrees for the first block
+	   of a saveset on disk, and a tape gives us whole blocks.  */
+	if (bsize != 0 && bsize != blksize) {
+		pb->err = PB_BSIZE;
+		pb->bad = bsize;
+		return;
+	}
+
+	/* find the records */
+	while (i < (blksize - sizeof(struct brh))) {
+		rh = (struct brh *) &block[i];
+		i += sizeof(struct brh);
+		rsize = getu16 ((unsigned char *)rh->brh_dol_w_rsize);
+		if (rsize > blksize - i) {
+			pb->err = PB_RSIZE;
+			pb->bad = rsize;
+			pb->left = bsize - i;
+			return;
+		}
+		if (pb->nrec == pb->arec) {
+			pb->arec = pb->arec ? 2 * pb->arec : 64;
+			pb->rec = realloc (pb->rec, pb->arec * sizeof (*pb->rec));
+			if (pb->rec == NULL) {
+				fprintf (stderr, "out of memory\n");
+				exit (EXIT_FAILURE);
+			}
+		}
+		r = &pb->rec[pb->nrec++];
+		r->type = getu16 ((unsigned char *)rh->brh_dol_w_rtype);
+		r->size = rsize;
+		r->data = &block[i];
+		r->conv_n = 0;
+		r->bad = 0;
+		if (r->type == brh_dol_k_summary)
+			r->bad = !check_attrs(r->data, rsize, 1);
+		else if (r->type == brh_dol_k_file)
+			r->bad = !check_attrs(r->data, rsize, 0);
+#ifdef pyr
+		i = i + rsize;
+#else
+		i += rsize;
+#endif
+	}
+}
+
+static void apply_block(struct pblock *pb)
+{
+	unsigned char	*block = pb->block;
+	int		blksize = pb->len;
+	unsigned short	rsize, rtype;
+	unsigned long	bsize, i;
+	unsigned long	bnumber;
+	struct prec	*r;
+
+	block_header = (struct bbh *) block;
+	i = sizeof(struct bbh);
 
 #ifdef	DEBUG
 	if (debugflag) {
@@ -1078,25 +1538,23 @@ void process_block(unsigned char *block, int blksize)
 	    hexdump((unsigned char *)block_header, sizeof(struct bbh), stdout);
 	}
 #endif
-	bhsize = getu16 ((unsigned char *)block_header->bbh_dol_w_size);
 	bsize = getu32 ((unsigned char *)block_header->bbh_dol_l_blocksize);
 
-	/* check the validity of the header block */
-	if (bhsize != sizeof(struct bbh)) {
+	if (pb->err == PB_BHSIZE) {
 		fprintf (stderr,
-			 "Invalid header block size: expected %ld got %d\n",
+			 "Invalid header block size: expected %ld got %ld\n",
 			 sizeof (struct bbh),
-			 bhsize);
+			 pb->bad);
 		exit(EXIT_FAILURE);
 	}
-	if (bsize != 0 && bsize != blksize) {
+	if (pb->err == PB_BSIZE) {
 	    if (bsize > blksize) {
 		printf("Snark: Block header blocksize too large, aborting\n");
 		exit(EXIT_FAILURE);
 	    }
-	    printf("Detected changed blocksize, assuming Save Set\n");
-	    blocksize = bsize;
-	    vmsbackup();
+	    printf("Snark: Block header blocksize %ld does not match %d, aborting\n",
+		   bsize, blksize);
+	    exit(EXIT_FAILURE);
 	}
 
         bnumber = getu32((unsigned char *)block_header->bbh_dol_l_number);
@@ -1104,18 +1562,12 @@ void process_block(unsigned char *block, int blksize)
 	if (debugflag)
 		printf("new block #%ld: i = %ld, bsize = 0x%lx/%ld\n", bnumber, i, bsize, bsize);
 #endif
-	/* read the records */
-	while (i < (blksize - sizeof(struct brh))) {
-		/* read the backup record header */
-		record_header = (struct brh *) &block[i];
-		i += sizeof(struct brh);
-
-		rtype = getu16 ((unsigned char *)record_header->brh_dol_w_rtype);
-		rsize = getu16 ((unsigned char *)record_header->brh_dol_w_rsize);
-	    if (rsize > (bsize - i + 1)) {
-		printf("Record size %d larger than remaining block size (%ld), aborting\n", rsize, (bsize-i));
-		exit(EXIT_FAILURE);
-	    }
+	/* act on the records */
+	for (r = pb->rec; r < pb->rec + pb->nrec; r++) {
+		record_header = (struct brh *) (r->data - sizeof(struct brh));
+		rtype = r->type;
+		rsize = r->size;
+		i = r->data - block;
 #ifdef	DEBUG
 	        if (debugflag)
 		{
@@ -1132,7 +1584,6 @@ void process_block(unsigned char *block, int blksize)
 #endif
 
 		switch (rtype) {
-
 		case brh_dol_k_null:
 #ifdef	DEBUG
 			if (debugflag)
@@ -1147,7 +1598,11 @@ void process_block(unsigned char *block, int blksize)
 			if (debugflag)
 				printf("rtype = %d:summary\n", rtype);
 #endif
-			process_summary (&block[i], rsize);
+			if (r->bad) {
+				if (tflag)
+					printf ("Cannot print summary; invalid data header\n");
+			} else
+				process_summary (&block[i], rsize);
 			break;
 
 		case brh_dol_k_file:
@@ -1155,7 +1610,10 @@ void process_block(unsigned char *block, int blksize)
 			if (debugflag)
 				printf("rtype = %d:file\n", rtype);
 #endif
-			process_file(&block[i], rsize);
+			if (r->bad)
+				bad_file(bnumber);
+			else
+				process_file(&block[i], rsize);
 			break;
 
 		case brh_dol_k_vbn:
@@ -1163,7 +1621,10 @@ void process_block(unsigned char *block, int blksize)
 			if (debugflag)
 				printf("rtype = %d:vbn\n", rtype);
 #endif
+			if (r->conv_n > 0)
+				vbn_conv = r;
 			process_vbn(&block[i], rsize);
+			vbn_conv = NULL;
 			break;
 
 		case brh_dol_k_physvol:
@@ -1201,81 +1662,993 @@ void process_block(unsigned char *block, int blksize)
 #endif
 			break;
 		}
-#ifdef pyr
-		i = i + rsize;
-#else
 		i += rsize;
-#endif
 #ifdef DEBUG
     if (debugflag) {
 	printf("expecting next record, i at 0x%lx/%ld of 0x%x/%d\n", i, i, blksize, blksize);
     }
 #endif
 	}
-    return;
+	if (pb->err == PB_RSIZE) {
+		if (salvage) {
+			fprintf(stderr, "Block %lu: record size %ld larger than remaining block size (%ld), rest of block skipped\n",
+				bnumber, pb->bad, pb->left);
+			salv_damage++;
+			salvage_file();
+			return;
+		}
+		printf("Record size %ld larger than remaining block size (%ld), aborting\n", pb->bad, pb->left);
+		exit(EXIT_FAILURE);
+	}
 }
 
-
-int rdhead(void)
+void process_block(unsigned char *block, int blksize)
 {
-	int i, nfound;
-	char name[80];
-	nfound = 1;
+	static struct pblock pb;
+
+	parse_block(&pb, block, blksize);
+	apply_block(&pb);
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ *  Batches.  When extracting from a saveset on disk with more than one
+ *  thread (-j), blocks are taken BATCH_BLOCKS at a time.  The threads
+ *  first parse the blocks of a batch side by side.  A quick pass in order
+ *  then follows the files through the batch, to find out which VBN
+ *  records hold the text of a stream file and how much of each is file
+ *  data; the threads convert that text (carriage returns, --to-utf8),
+ *  and at last apply_block goes through the blocks in order just as it
+ *  does for a single block, writing out what has been converted.  The
+ *  records of the other formats are left for apply_block: where one
+ *  starts can only be found by following them from the start of the
+ *  file.
+ */
+#define BATCH_BLOCKS	64
+
+/* Nonzero if blocks are processed in batches by several threads.  */
+static int batching;
+
+static struct pblock batch[BATCH_BLOCKS];
+static int batch_count;
+/* Copies of the blocks, unless the input keeps them for us.  */
+static unsigned char *batch_copy;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *batch_threads;
+/* The job in hand: BATCH_FN is to be called for 0 to BATCH_JOBS - 1,
+   and BATCH_NEXT is the next of those to start.  */
+static void (*batch_fn)(int);
+static int batch_jobs, batch_next, batch_busy;
+
+/* Where the files in the batch are, as far as batch_plan is concerned.  */
+static int plan_how, plan_size, plan_count;
+
+/* Do jobs until there are none left.  Called with BATCH_LOCK held.  */
+static void batch_take(void)
+{
+	int k;
+
+	while (batch_next < batch_jobs) {
+		k = batch_next++;
+		batch_busy++;
+		pthread_mutex_unlock(&batch_lock);
+		batch_fn(k);
+		pthread_mutex_lock(&batch_lock);
+		if (--batch_busy == 0 && batch_next == batch_jobs)
+			pthread_cond_signal(&batch_done);
+	}
+}
+
+static void *batch_worker(void *arg)
+{
+	pthread_mutex_lock(&batch_lock);
+	for (;;) {
+		while (batch_next >= batch_jobs)
+			pthread_cond_wait(&batch_work, &batch_lock);
+		batch_take();
+	}
+	return NULL;
+}
+
+/* Call FN for 0 to N - 1, spread over the threads, and wait until they
+   have all been done.  */
+static void batch_run(void (*fn)(int), int n)
+{
+	pthread_mutex_lock(&batch_lock);
+	batch_fn = fn;
+	batch_jobs = n;
+	batch_next = 0;
+	pthread_cond_broadcast(&batch_work);
+	batch_take();
+	while (batch_busy > 0)
+		pthread_cond_wait(&batch_done, &batch_lock);
+	pthread_mutex_unlock(&batch_lock);
+}
+
+static void batch_start(void)
+{
+	int i;
+
+	xlate_init();
+	batch_threads = calloc(nthreads, sizeof (pthread_t));
+	if (batch_threads == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The main thread works too.  */
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&batch_threads[i], NULL, batch_worker,
+				   NULL) != 0)
+			break;
+}
+
+static void batch_parse(int k)
+{
+	parse_block(&batch[k], batch[k].block, batch[k].len);
+}
+
+/* The attribute record of type DTYPE in the file record BUFFER, or
+   NULL.  */
+static unsigned char *file_attr(unsigned char *buffer, size_t rsize,
+				int dtype, unsigned *sizep)
+{
+	unsigned char *found = NULL;
+	unsigned dsize;
+	size_t c;
+
+	/* check_attrs has been through them */
+	for (c = 2; c + 4 <= rsize; c += dsize + 4) {
+		dsize = getu16 (&buffer[c]);
+		if (getu16 (&buffer[c + 2]) == dtype) {
+			found = &buffer[c + 4];
+			*sizep = dsize;
+		}
+	}
+	return found;
+}
+
+/* Follow the files through the batch, in order, and mark the VBN
+   records whose text can be converted ahead.  */
+static void batch_plan(void)
+{
+	struct pblock *pb;
+	struct prec *r;
+	unsigned char *data;
+	unsigned dsize;
+	long nblk;
+	int fmt, n;
+
+	for (pb = batch; pb < batch + batch_count; pb++)
+		for (r = pb->rec; r < pb->rec + pb->nrec; r++) {
+			if (r->type == brh_dol_k_file) {
+				plan_how = plan_count = 0;
+				if (r->bad || flag_binary)
+					continue;
+				data = file_attr(r->data, r->size, ATR_RECORD,
+						 &dsize);
+				if (data == NULL)
+					continue;
+				fmt = data[0];
+				if (fmt == FAB$C_STMCR)
+					plan_how |= CONV_CRLF;
+				if (to_utf8 && (fmt == FAB$C_STM
+						|| fmt == FAB$C_STMLF
+						|| fmt == FAB$C_STMCR))
+					plan_how |= CONV_UTF8;
+				/* as in process_file */
+				nblk = getu16 (&data[10])
+					+ (64 * 1024) * getu16 (&data[8]);
+				plan_size = (nblk-1)*512
+					+ (short)getu16 (&data[12]);
+			} else if (r->type == brh_dol_k_vbn && plan_how != 0
+				   && plan_count < plan_size) {
+				n = plan_size - plan_count;
+				if (n > r->size)
+					n = r->size;
+				r->conv_how = plan_how;
+				r->conv_n = n;
+				r->conv = pb->conv + 2 * (r->data - pb->block);
+				plan_count += n;
+			}
+		}
+}
+
+static void batch_convert(int k)
+{
+	unsigned char tmp[65536];
+	unsigned char *src;
+	struct prec *r;
+
+	for (r = batch[k].rec; r < batch[k].rec + batch[k].nrec; r++) {
+		if (r->conv_n == 0)
+			continue;
+		src = r->data;
+		r->conv_len = r->conv_n;
+		if (r->conv_how & CONV_CRLF) {
+			xlate_crlf(tmp, src, r->conv_n);
+			src = tmp;
+		}
+		if ((r->conv_how & CONV_UTF8)
+		    && xlate_ascii(src, r->conv_n) < r->conv_n)
+			r->conv_len = xlate_utf8(r->conv, src, r->conv_n,
+						 to_utf8);
+		else if (src == r->data)
+			r->conv = r->data;	/* nothing to change */
+		else
+			memcpy(r->conv, src, r->conv_n);
+	}
+}
+
+/* Process the blocks collected so far.  */
+static void batch_flush(void)
+{
+	int k;
+
+	if (batch_count == 0)
+		return;
+	if (batch_threads == NULL)
+		batch_start();
+	batch_run(batch_parse, batch_count);
+	for (k = 0; k < batch_count; k++)
+		if (batch[k].err == PB_BHSIZE || batch[k].err == PB_BSIZE) {
+			batch_count = k + 1;
+			break;
+		}
+	batch_plan();
+	batch_run(batch_convert, batch_count);
+	for (k = 0; k < batch_count; k++)
+		apply_block(&batch[k]);
+	batch_count = 0;
+}
+
+/* Add BLOCK, of BLKSIZE bytes, to the batch.  */
+static void batch_add(unsigned char *block, int blksize)
+{
+	struct pblock *pb = &batch[batch_count];
+
+	if (pb->conv == NULL || pb->len < blksize) {
+		free(pb->conv);
+		pb->conv = malloc(2 * blksize);
+		if (pb->conv == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!tape_stable()) {
+		if (batch_copy == NULL)
+			batch_copy = malloc(BATCH_BLOCKS * blocksize);
+		if (batch_copy == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(batch_copy + batch_count * blocksize, block, blksize);
+		block = batch_copy + batch_count * blocksize;
+	}
+	pb->block = block;
+	pb->len = blksize;
+	if (++batch_count == BATCH_BLOCKS)
+		batch_flush();
+}
+#endif /* HAVE_PTHREAD */
+
+/*
+ *  Redundancy groups.  A saveset written with a nonzero /GROUP_SIZE has
+ *  an XOR block after each group of that many blocks, which holds the
+ *  XOR of everything in them but the block headers.  Every block goes
+ *  through group_block, which does the --verify-crc checks and drops the
+ *  XOR blocks before anything else looks at them.
+ *
+ *  Where a block may go bad (--verify-crc, or a read error on a tape)
+ *  we also keep the XOR of the good blocks of the group as they go by.
+ *  When one of them is bad, it and the rest of the group are held back
+ *  until the XOR block comes; the bad block is then rebuilt from the two
+ *  XORs and they all go on in order.  A second bad block in the same
+ *  group, or a bad XOR block, leaves them as they are; a block that
+ *  could not be read is then lost, which cuts the file it was in short
+ *  with --salvage and is the end of the run without.
+ *
+ *  A block is only taken for an XOR block if the saveset has groups and
+ *  it comes where the XOR block of one should: after GROUP_SIZE blocks,
+ *  or after fewer at the end of the saveset.  Since we cannot tell the
+ *  latter until the saveset ends, such a block is kept in GRP_EARLY
+ *  until then.  One anywhere else is counted as damage and skipped, and
+ *  the groups are counted afresh from it.
+ */
+
+static int grp_keep;		/* nonzero to keep the XOR of the group */
+static int grp_size;		/* from the summary, or -1 before that */
+static int grp_count;		/* blocks of the group so far */
+static int grp_lost;		/* which of them is bad, -1 for none, or
+				   -2 if there is no rebuilding it */
+static int grp_unread;		/* nonzero if it could not even be read */
+static int grp_held;		/* blocks held back, starting with it */
+static unsigned long grp_number;	/* number of the last good block */
+static int grp_len;
+static unsigned char *grp_xor;	/* XOR of the good blocks of the group */
+/* The blocks held back, and after grp_size + 1 of them the bad block as
+   it came.  */
+static unsigned char *grp_blocks;
+/* An XOR block that came before its group was full, if GRP_EARLY_LEN is
+   nonzero, and whether it was bad.  */
+static unsigned char *grp_early;
+static int grp_early_len, grp_early_bad, grp_early_size;
+
+static void group_pass(unsigned char *block, int blksize)
+{
+#ifdef HAVE_PTHREAD
+	if (batching)
+		batch_add(block, blksize);
+	else
+#endif
+		process_block(block, blksize);
+}
+
+/* The group size from the summary record, if there is one in BLOCK,
+   the first block of a saveset; otherwise 0.  */
+static int summary_group(unsigned char *block, int blksize)
+{
+	struct brh *rh;
+	unsigned char *data;
+	unsigned rsize, dsize, type, c;
+	int i;
+
+	for (i = sizeof(struct bbh); i + sizeof(struct brh) <= blksize;
+	     i += rsize) {
+		rh = (struct brh *) &block[i];
+		i += sizeof(struct brh);
+		rsize = getu16 (rh->brh_dol_w_rsize);
+		data = &block[i];
+		if (rsize > blksize - i)
+			break;
+		if (getu16 (rh->brh_dol_w_rtype) != brh_dol_k_summary)
+			continue;
+		if (!check_attrs(data, rsize, 1))
+			break;
+		for (c = 2; c + 4 <= rsize; c += dsize + 4) {
+			dsize = getu16 (&data[c]);
+			type = getu16 (&data[c + 2]);
+			if (type == 0 && dsize > 0)
+				break;
+			if (type == 14 && dsize >= 2)
+				return getu16 (&data[c + 4]);
+		}
+		break;
+	}
+	return 0;
+}
+
+/* Start afresh for a new saveset.  */
+static void group_reset(void)
+{
+	grp_size = -1;
+	grp_count = grp_held = 0;
+	grp_lost = -1;
+}
+
+/* Send on the blocks held back, with the bad one rebuilt from the XOR
+   block XBLOCK, or as it came if XBLOCK is NULL.  */
+static void group_release(unsigned char *xblock)
+{
+	unsigned char *lost = grp_blocks;
+	unsigned char *orig = grp_blocks + (grp_size + 1) * grp_len;
+	struct bbh *bh = (struct bbh *) lost;
+	size_t hsize = sizeof(struct bbh);
+	int i, ok = 0, sure = 0;
+
+	if (xblock != NULL) {
+		/* Keep the header the block came with if that is whole,
+		   so that its CRC tells us whether we got it right.  */
+		sure = !grp_unread && !(check_crc(orig, grp_len) & BAD_CHECKSUM);
+		if (sure)
+			memcpy(lost, orig, hsize);
+		else {
+			memcpy(lost, xblock, hsize);
+			putu32((getu32(bh->bbh_dol_l_flags) & ~BBH_M_XOR)
+			       | BBH_M_NOCRC, bh->bbh_dol_l_flags);
+			putu32(grp_number + 1, bh->bbh_dol_l_number);
+			putu16(header_sum(lost), bh->bbh_dol_w_checksum);
+		}
+		memcpy(lost + hsize, xblock + hsize, grp_len - hsize);
+		block_xor(lost + hsize, grp_xor + hsize, grp_len - hsize);
+		ok = !sure || check_crc(lost, grp_len) == 0;
+	}
+	if (ok)
+		fprintf(stderr, "Block %lu: rebuilt from its redundancy group\n",
+			grp_number + 1);
+	else if (grp_unread) {
+		fprintf(stderr, "Block %lu: lost, it could not be read\n",
+			grp_number + 1);
+		salv_damage++;
+#ifdef HAVE_PTHREAD
+		if (batching)
+			batch_flush();
+#endif
+		if (!salvage)
+			exit(EXIT_FAILURE);
+		salvage_file();
+	} else {
+		memcpy(lost, orig, grp_len);
+		crc_errors++;
+	}
+	for (i = ok || !grp_unread ? 0 : 1; i < grp_held; i++)
+		group_pass(grp_blocks + i * grp_len, grp_len);
+#ifdef HAVE_PTHREAD
+	/* Make sure the batch is done with grp_blocks.  */
+	if (batching)
+		batch_flush();
+#endif
+	grp_lost = -2;
+	grp_held = 0;
+}
+
+static void group_xor(unsigned char *block, int blksize, int bad);
+
+/* The end of a saveset, or of the tape.  */
+static void group_end(void)
+{
+	int len = grp_early_len;
+
+	if (len > 0) {
+		grp_early_len = 0;
+		group_xor(grp_early, len, grp_early_bad);
+	}
+	if (grp_lost >= 0)
+		group_release(NULL);
+	group_reset();
+}
+
+static void group_alloc(int blksize)
+{
+	if (grp_xor != NULL && grp_len == blksize)
+		return;
+	free(grp_xor);
+	free(grp_blocks);
+	grp_len = blksize;
+	grp_xor = malloc(blksize);
+	grp_blocks = malloc((size_t) (grp_size + 2) * blksize);
+	if (grp_xor == NULL || grp_blocks == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Hold back the bad block BLOCK, or one that could not be read if BLOCK
+   is NULL, to be rebuilt when the group is complete.  */
+static void group_lose(unsigned char *block)
+{
+	grp_lost = grp_count++;
+	grp_unread = block == NULL;
+	grp_held = 1;
+	if (block == NULL)
+		memset(grp_blocks, 0, grp_len);
+	else
+		memcpy(grp_blocks + (grp_size + 1) * grp_len, block, grp_len);
+}
+
+/* The next block of the saveset could not be read.  Returns nonzero if
+   it can be rebuilt later.  */
+static int group_unread(void)
+{
+	if (!grp_keep || grp_size <= 0 || grp_lost != -1 || grp_xor == NULL
+	    || grp_count >= grp_size)
+		return 0;
+	if (grp_count == 0)
+		memset(grp_xor, 0, grp_len);
+	group_lose(NULL);
+	return 1;
+}
+
+/* BLOCK, bad if BAD is nonzero, is the XOR block of the group.  */
+static void group_xor(unsigned char *block, int blksize, int bad)
+{
+	if (bad)
+		crc_errors++;
+	if (grp_lost >= 0)
+		group_release(bad || blksize != grp_len ? NULL : block);
+	grp_count = 0;
+	grp_lost = -1;
+}
+
+/* Block NUMBER says it is an XOR block, but it is not where one goes.  */
+static void group_stray(unsigned long number)
+{
+	fprintf(stderr, "Block %lu: XOR block out of place, skipped\n",
+		number);
+	salv_damage++;
+	if (grp_lost >= 0)
+		group_release(NULL);
+	grp_count = 0;
+	grp_lost = -1;
+}
+
+/* Take the next block of the saveset, BLOCK of BLKSIZE bytes.  */
+static void group_block(unsigned char *block, int blksize)
+{
+	struct bbh *bh = (struct bbh *) block;
+	unsigned long number = getu32 (bh->bbh_dol_l_number);
+	int bad = 0;
+
+	if (grp_size < 0)
+		grp_size = summary_group(block, blksize);
+	if (verify_crc) {
+		bad = check_crc(block, blksize);
+		if (bad & BAD_CHECKSUM)
+			fprintf(stderr, "Block %lu: header checksum error\n",
+				number);
+		if (bad & BAD_CRC)
+			fprintf(stderr, "Block %lu: CRC error\n", number);
+	}
+	if (grp_early_len > 0) {
+		/* The saveset goes on, so that was not the last group.  */
+		grp_early_len = 0;
+		group_stray(getu32 (((struct bbh *) grp_early)->bbh_dol_l_number));
+	}
+
+	if ((getu32 (bh->bbh_dol_l_flags) & BBH_M_XOR) && grp_size > 0) {
+		if (grp_count == grp_size)
+			group_xor(block, blksize, bad);
+		else if (grp_count == 0)
+			group_stray(number);
+		else {
+			if (grp_early_size < blksize) {
+				free(grp_early);
+				grp_early = malloc(blksize);
+				if (grp_early == NULL) {
+					fprintf(stderr, "out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				grp_early_size = blksize;
+			}
+			memcpy(grp_early, block, blksize);
+			grp_early_len = blksize;
+			grp_early_bad = bad;
+		}
+		return;
+	}
+	if (getu32 (bh->bbh_dol_l_flags) & BBH_M_XOR)
+		fprintf(stderr, "Block %lu: marked as an XOR block, but the "
+			"saveset has no redundancy groups\n", number);
+	if (!grp_keep || grp_size <= 0) {
+		if (bad)
+			crc_errors++;
+		if (grp_size > 0)
+			grp_count++;
+		group_pass(block, blksize);
+		return;
+	}
+
+	group_alloc(blksize);
+	if (grp_count == 0)
+		memset(grp_xor, 0, blksize);
+	if (grp_lost >= 0) {
+		if (!bad && grp_held <= grp_size) {
+			memcpy(grp_blocks + grp_held++ * blksize, block,
+			       blksize);
+			block_xor(grp_xor, block, blksize);
+			grp_count++;
+			return;
+		}
+		/* A second bad block, or no XOR block in sight.  */
+		group_release(NULL);
+	} else if (bad && grp_lost == -1 && grp_count < grp_size) {
+		group_lose(block);
+		return;
+	}
+	if (bad)
+		crc_errors++;
+	else {
+		block_xor(grp_xor, block, blksize);
+		grp_number = number;
+	}
+	grp_count++;
+	group_pass(block, blksize);
+}
+
+/*
+ *  Salvage (--salvage).  Rather than giving up at a damaged block, we
+ *  say so, cut the file being extracted short, and carry on with the
+ *  next block that looks right.  On a tape every record is a block of
+ *  its own, so that is simply the next good one.  In a saveset on disk
+ *  bytes may have gone missing or crept in, and then the blocks that
+ *  follow no longer start where we expect them.  So we look for the
+ *  next block header in what we read, finding candidates with memchr
+ *  for a byte of the block size, which sits at a fixed place in the
+ *  header, and read on from there.
+ */
+
+/* Read errors in a row on a tape before we give up.  */
+#define SALVAGE_TRIES	16
+
+/* Nonzero while we are looking for a block header; how many bytes have
+   gone by since.  */
+static int salv_lost;
+static unsigned long salv_skipped;
+/* The number of the last good block.  */
+static unsigned long salv_number;
+static unsigned char *salv_buf;
+static int salv_len;
+
+/* Is the header at P, which has N bytes behind it, one that parse_block
+   takes for a block of BLKSIZE bytes?  For a candidate found by
+   salvage_find (CANDIDATE nonzero), as far as we can see, the first
+   record must look right too.  */
+static int header_ok(unsigned char *p, int n, int blksize, int candidate)
+{
+	struct bbh *bh = (struct bbh *) p;
+	struct brh *rh = (struct brh *) (p + sizeof(struct bbh));
+	unsigned long bsize;
+
+	if (n < sizeof(struct bbh))
+		return 0;
+	bsize = getu32 (bh->bbh_dol_l_blocksize);
+	if (getu16 (bh->bbh_dol_w_size) != sizeof(struct bbh)
+	    || (bsize != blksize && (candidate || bsize != 0)))
+		return 0;
+	if (candidate && n >= sizeof(struct bbh) + sizeof(struct brh))
+		return getu16 (rh->brh_dol_w_rtype) <= brh_dol_k_fid
+			&& getu16 (rh->brh_dol_w_rsize)
+			<= blksize - sizeof(struct bbh) - sizeof(struct brh);
+	return 1;
+}
+
+/* Where in the N bytes at P, from FROM on, the next block of BLKSIZE
+   bytes may start, or -1.  A header which begins near the end of P can
+   only be checked in part; so can one we see the tail of at the start of
+   P, and then it is the one after it that we go for.  */
+static int salvage_find(unsigned char *p, int n, int blksize, int from)
+{
+	unsigned char want[4], *q;
+	int i, k, o;
+
+	putu32(blksize, want);
+	for (i = 0; want[i] == 0; i++)
+		;
+	k = offsetof(struct bbh, bbh_dol_l_blocksize) + i;
+	for (q = p; (q = memchr(q, want[i], p + n - q)) != NULL; q++) {
+		o = q - p - k;
+		if (o < from)
+			o += blksize;
+		if (o >= n)
+			continue;
+		if (o + sizeof(struct bbh) <= n) {
+			if (header_ok(p + o, n - o, blksize, 1))
+				return o;
+		} else if (p[o] == 0 && (o + 1 == n || p[o + 1] == 1))
+			return o;
+	}
+	return -1;
+}
+
+/* Something is missing after the last good block: finish with what
+   came before it, and cut the file we were writing short.  */
+static void salvage_cut(void)
+{
+	salv_damage++;
+	if (grp_lost >= 0)
+		group_release(NULL);
+	grp_lost = -2;
+#ifdef HAVE_PTHREAD
+	if (batching)
+		batch_flush();
+#endif
+	salvage_file();
+}
+
+/* Where the record chain of BLOCK breaks off, or 0 if it does not;
+   parse_block walks it the same way.  */
+static int chain_break(unsigned char *block, int blksize)
+{
+	unsigned long i = sizeof(struct bbh);
+	unsigned rsize;
+
+	while (i < blksize - sizeof(struct brh)) {
+		rsize = getu16 (&block[i]);
+		i += sizeof(struct brh);
+		if (rsize > blksize - i)
+			return i - sizeof(struct brh);
+		i += rsize;
+	}
+	return 0;
+}
+
+/* The next block starts at offset O of BLOCK: put it together from the
+   rest of BLOCK and the next O bytes of the saveset.  Returns NULL if
+   the saveset ends first.  */
+static unsigned char *salvage_take(unsigned char *block, int o, int blksize)
+{
+	unsigned char *p;
+
+	if (salv_len < blksize) {
+		salv_buf = realloc(salv_buf, blksize);
+		if (salv_buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		salv_len = blksize;
+	}
+	/* BLOCK may be salv_buf itself.  */
+	memmove(salv_buf, block + o, blksize - o);
+	if (tape_next(&p, o) != o)
+		return NULL;
+	memcpy(salv_buf + blksize - o, p, o);
+	return salv_buf;
+}
+
+/* The block BLOCK of BLKSIZE bytes has a bad header.  Returns the block
+   to go on with, or NULL to read on.  */
+static unsigned char *salvage_resync(unsigned char *block, int blksize)
+{
+	int o;
+
+	if (!salv_lost) {
+		fprintf(stderr, "Bad block header after block %lu, looking for the next block\n",
+			salv_number);
+		salvage_cut();
+		salv_lost = 1;
+	}
+	if (!tape_bytes() || (o = salvage_find(block, blksize, blksize, 1)) < 0) {
+		salv_skipped += blksize;
+		return NULL;
+	}
+	salv_skipped += o;
+	return salvage_take(block, o, blksize);
+}
+
+/* Take the next block BLOCK of BLKSIZE bytes in salvage mode.  A block
+   whose records break off may have the start of the next one after the
+   break, when something is missing from it; then we go on from there.  */
+static void salvage_block(unsigned char *block, int blksize)
+{
+	int brk, o;
+
+	for (;;) {
+		while (!header_ok(block, blksize, blksize, 0)) {
+			block = salvage_resync(block, blksize);
+			if (block == NULL)
+				return;
+		}
+		salv_number = getu32 (((struct bbh *) block)->bbh_dol_l_number);
+		if (salv_lost) {
+			fprintf(stderr, "Going on at block %lu, %lu bytes skipped\n",
+				salv_number, salv_skipped);
+			salv_lost = 0;
+			salv_skipped = 0;
+		}
+		group_block(block, blksize);
+#ifdef HAVE_PTHREAD
+		/* Make sure the batch is done with salv_buf.  */
+		if (batching && block == salv_buf)
+			batch_flush();
+#endif
+		brk = chain_break(block, blksize);
+		if (brk == 0 || !tape_bytes()
+		    || (o = salvage_find(block, blksize, blksize, brk)) < 0)
+			return;
+#ifdef HAVE_PTHREAD
+		/* Let what it has to say about the block come first.  */
+		if (batching)
+			batch_flush();
+#endif
+		fprintf(stderr, "Block %lu: the next block starts at offset %d\n",
+			salv_number, o);
+		block = salvage_take(block, o, blksize);
+		if (block == NULL)
+			return;
+	}
+}
+
+/* The saveset name from the last HDR1 or EOF1 label.  */
+static char setname[80];
+/* Nonzero while toc_seek is finding out whether it is in the right
+   place; nothing is shown until it knows.  */
+static int label_quiet;
+
+/* Act on the tape label LAB: show the volume and saveset names, and
+   pick up the saveset number and the block size.  Returns 1 for the HDR2
+   label, which the header of a saveset ends with, and 0 otherwise.  */
+static int label_record(char *lab)
+{
+	char *name = setname;
+
+	if (strncmp(lab, "VOL1",4) == 0) {
+		sscanf(lab+4, "%14s", name);
+		if((vflag || tflag) && !label_quiet)
+			printf("Volume: %s\n",name);
+		toc_load(name);
+	}
+	if (strncmp(lab, "HDR1",4) == 0) {
+		sscanf(lab+4, "%14s", name);
+		sscanf(lab+31, "%4d", &setnr);
+	}
+	/* get the block size */
+	if (strncmp(lab, "HDR2", 4) == 0) {
+		sscanf(lab+5, "%5d", &blocksize);
+#ifdef	DEBUG
+		if (debugflag)
+			printf("\n\tblocksize = %d\n", blocksize);
+#endif
+		if((vflag || tflag) && !label_quiet)
+			printf("Saveset name: %s   number: %d\n",name,setnr);
+		return 1;
+	}
+	if (strncmp(lab, "EOF1",4) == 0) {
+		sscanf(lab+4, "%14s", name);
+		if((vflag || tflag) && !label_quiet)
+			printf("End of saveset: %s\n\n\n",name);
+	}
+	return 0;
+}
+
+int rdhead(void)
+{
+	int i, nfound;
+	int file;
+	long block;
+	nfound = 1;
 #ifdef	DEBUG
     if (debugflag)
 	    printf("rdhead\n");
 #endif
+	/* where these labels are, for the table of contents */
+	file = tape_fileno();
+	block = tape_block();
 	/* read the tape label - 4 records of 80 bytes */
-	while ((i = read(fd, label, LABEL_SIZE)) != 0) {
+	while ((i = tape_read(label, LABEL_SIZE)) != 0) {
 		if (i != LABEL_SIZE) {
+			if (label_quiet)
+				return 1;	/* not labels; see toc_seek */
 			fprintf(stderr, "Snark: bad label record\n");
 			exit(EXIT_FAILURE);
 		}
-		if (strncmp(label, "VOL1",4) == 0) {
-			sscanf(label+4, "%14s", name);
-			if(vflag || tflag) printf("Volume: %s\n",name);
-		}
-		if (strncmp(label, "HDR1",4) == 0) {
-			sscanf(label+4, "%14s", name);
-			sscanf(label+31, "%4d", &setnr);
-		}
-		/* get the block size */
-		if (strncmp(label, "HDR2", 4) == 0) {
+		if (label_record(label))
 			nfound = 0;
-			sscanf(label+5, "%5d", &blocksize);
-#ifdef	DEBUG
-			if (debugflag)
-				printf("\n\tblocksize = %d\n", blocksize);
-#endif
-		}
-	}
-	if((vflag || tflag) && !nfound) 
-		printf("Saveset name: %s   number: %d\n",name,setnr);
-	/* get the block buffer */
-	block = (unsigned char *) malloc(blocksize);
-	if (block == (unsigned char *) 0) {
-		fprintf(stderr, "memory allocation for block failed\n");
-		exit(EXIT_FAILURE);
 	}
+	if (!nfound)
+		toc_note(setnr, setname, file, block, tape_image());
 	return(nfound);
 }
 
 void rdtail(void)
 {
 	int i;
-	char name[80];
 	/* read the tape label - 4 records of 80 bytes */
-	while ((i = read(fd, label, LABEL_SIZE)) != 0) {
+	while ((i = tape_read(label, LABEL_SIZE)) != 0) {
 		if (i != LABEL_SIZE) {
 			fprintf(stderr, "Snark: bad label record\n");
 			exit(EXIT_FAILURE);
 		}
-		if (strncmp(label, "EOF1",4) == 0) {
-			sscanf(label+4, "%14s", name);
-			if(vflag || tflag)
-				printf("End of saveset: %s\n\n\n",name);
+		label_record(label);
+	}
+}
+
+/* Copy the tape, records and tape marks as they are, to the SIMH image
+   IMAGE_FILE, up to the double tape mark at the end, so that everything
+   else can be done from the image once the drive is free.  Nothing is
+   decoded on the way except the labels, which are shown as usual.  A
+   record the drive cannot read goes into the image as a bad record, as
+   SIMH would have it, and the copy carries on; after IMAGE_MAXBAD of
+   them in a row we give up.  Returns nonzero if any were bad.  */
+#define IMAGE_MAXBAD	100
+
+static int image_tape(void)
+{
+	unsigned char *rec;
+	int i, marks, files, inarow;
+	unsigned long records, bad;
+	double bytes, secs;
+	struct timeval start, end;
+
+	image_create(image_file);
+	gettimeofday(&start, NULL);
+	marks = files = inarow = 0;
+	records = bad = 0;
+	bytes = 0;
+	while (marks < 2) {
+		i = tape_next(&rec, TAPE_MAXREC);
+		if (i < 0 && errno == EIO && inarow < IMAGE_MAXBAD) {
+			fprintf(stderr, "Record %lu: %s, copied as a bad record\n",
+				records + bad + 1, strerror(errno));
+			image_bad();
+			bad++;
+			inarow++;
+			marks = 0;
+			continue;
+		}
+		if (i < 0) {
+			perror ("error reading tape");
+			image_close();
+			exit (EXIT_FAILURE);
+		}
+		inarow = 0;
+		image_write(rec, i);
+		if (i == 0) {
+			marks++;
+			files++;
+			continue;
+		}
+		marks = 0;
+		records++;
+		bytes += i;
+		if (i == LABEL_SIZE) {
+			memcpy(label, rec, LABEL_SIZE);
+			label_record(label);
 		}
 	}
+	image_close();
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("Copied %lu records in %d tape files, %.1f MB in %.1f s",
+	       records, files - 1, bytes / 1e6, secs);
+	if (secs > 0)
+		printf(", %.1f MB/s", bytes / 1e6 / secs);
+	printf("\n");
+	if (bad > 0)
+		printf("%lu record%s could not be read\n", bad,
+		       bad == 1 ? "" : "s");
+	return bad > 0;
+}
+
+/* Take the block size of a saveset on disk from the header of its first
+   block, so that it is read in the right pieces from the start.  A
+   header that gives no block size (as RSTS/E's may) leaves the one from
+   -b alone.  */
+static void probe_blocksize(void)
+{
+	unsigned char *head;
+	struct bbh *bh;
+	unsigned long bsize;
+
+	if (tape_peek(&head) < sizeof(struct bbh))
+		return;
+	bh = (struct bbh *)head;
+	if (getu16(bh->bbh_dol_w_size) != sizeof(struct bbh))
+		return;		/* process_block will complain */
+	bsize = getu32(bh->bbh_dol_l_blocksize);
+#ifdef	DEBUG
+	if (debugflag)
+		printf("first block: opsys 0x%x, blocksize %ld\n",
+		       getu16(bh->bbh_dol_w_opsys), bsize);
+#endif
+	if (bsize == 0 || bsize == blocksize)
+		return;
+	if (bsize > TAPE_MAXREC) {
+		printf("Snark: Block header blocksize too large, aborting\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Detected changed blocksize, assuming Save Set\n");
+	blocksize = bsize;
+}
+
+/* Go straight to saveset SELSET if the table of contents of the tape
+   says where it is.  We have just read the labels of the first saveset,
+   and shown them.  Returns what rdhead does.  */
+static int toc_seek(void)
+{
+	int file, found, eoffl;
+	long block;
+
+	if (!toc_find(selset, tape_image(), &file, &block)
+	    || tape_seekfile(file, block) < 0)
+		return 0;
+	label_quiet = 1;
+	found = rdhead() == 0 && setnr == selset;
+	if (!found) {
+		/* Not what the table said, so it was for another tape with
+		   the same label.  Start again from the beginning without
+		   it; the first labels have been shown already.  */
+		toc_forget();
+		tape_open(tapefile);
+		eoffl = rdhead();
+	}
+	label_quiet = 0;
+	if (!found)
+		return eoffl;
+	if (vflag || tflag)
+		printf("Saveset name: %s   number: %d\n", setname, setnr);
+	return 0;
 }
 
 /* Perform the actual operation.  The way this works is that main () parses
@@ -1284,6 +2657,8 @@ void rdtail(void)
 void vmsbackup(void)
 {
 	int	i, eoffl;
+	/* Read errors in a row (--salvage).  */
+	int	errors = 0;
 
 	/* Nonzero if we are reading from a saveset on disk (as
 	   created by the /SAVE_SET qualifier to BACKUP) rather than from
@@ -1292,6 +2667,10 @@ void vmsbackup(void)
 
 	if (tapefile == NULL)
 		tapefile = def_tapefile;
+#ifdef _SC_NPROCESSORS_ONLN
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
 #ifdef	NEWD
 	/* open debug file */
@@ -1303,33 +2682,27 @@ void vmsbackup(void)
 #endif
 
 	/* open the tape file */
-	fd = open(tapefile, O_RDONLY);
-	if (fd < 0) {
-		perror(tapefile);
-		exit(EXIT_FAILURE);
-	}
-#if HAVE_MT_IOCTLS
-	/* rewind the tape */
-	op.mt_op = MTREW;
-	op.mt_count = 1;
-	i = ioctl(fd, MTIOCTOP, &op);
-	if (i < 0) {
-		if (errno == EINVAL || errno == ENOTTY) {
-			ondisk = 1;
-		} else {
-			perror(tapefile);
-			exit(EXIT_FAILURE);
-		}
-	}
-#else
-	ondisk = 1;
-#endif
+	ondisk = tape_open(tapefile);
 
 #ifdef DEBUG
     if (debugflag) {
 	printf("Opened '%s' as %s file: %d\n", tapefile, (ondisk?"disk":"tape"), fd);
     }
 #endif
+	if (image_file != NULL) {
+		if (ondisk) {
+			fprintf(stderr, "%s is not a tape\n", tapefile);
+			exit(EXIT_FAILURE);
+		}
+#ifdef HAVE_PTHREAD
+		/* Let the drive stream while the image is being written.  */
+		if (tape_buffer == 0)
+			tape_buffer = 64 * 1024 * 1024;
+#endif
+		i = image_tape();
+		tape_close();
+		exit(i ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
 	if (ondisk) {
 		/* process_block wants this to match the size which
 		   backup writes into the header.  Should it care in
@@ -1341,18 +2714,21 @@ void vmsbackup(void)
 		   RSTS/E save sets */
 		blocksize = 32256;
 #endif
-		block = malloc (blocksize);
-		if (block == (unsigned char *) 0) {
-			fprintf(stderr, "memory allocation for block failed\n");
-			exit(EXIT_FAILURE);
-		}
+		probe_blocksize();
 		eoffl = 0;
 	} else {
 		eoffl = rdhead();
+		if (sflag && !eoffl && setnr != selset)
+			eoffl = toc_seek();
 	}
 
 	nfiles = 0;
 	nblocks = 0;
+#ifdef HAVE_PTHREAD
+	batching = ondisk && xflag && nthreads > 1 && !debugflag;
+#endif
+	grp_keep = verify_crc || !ondisk;
+	group_reset();
 
 	/* read the backup tape blocks until end of tape */ 
 	while (!eoffl) {
@@ -1361,26 +2737,25 @@ void vmsbackup(void)
 				fprintf(stderr, "-s not supported for disk savesets\n");
 				exit(EXIT_FAILURE);
 			}
-#if HAVE_MT_IOCTLS
-			op.mt_op = MTFSF;
-			op.mt_count = 1;
-			i = ioctl(fd, MTIOCTOP, &op);
-			if (i < 0) {
+			if (tape_skipfile() < 0) {
 				perror(tapefile);
 				exit(EXIT_FAILURE);
 			}
-#else
-			abort ();
-#endif
 			i = 0;
 		}
 		else
-			i = read(fd, block, blocksize);
+			i = tape_next(&block, blocksize);
 #ifdef DEBUG
     if (debugflag) {
-	printf("Read %d of %d bytes, now at 0x%lx\n", i, blocksize, lseek(fd, 0, SEEK_CUR));
+	printf("Read %d of %d bytes, now at 0x%lx\n", i, blocksize, tape_tell());
     }
 #endif
+		if (i != blocksize && i != -1) {
+			group_end();
+#ifdef HAVE_PTHREAD
+			batch_flush();
+#endif
+		}
 		if(i == 0) {
 			if (ondisk) {
 				/* No need to support multiple save sets.  */
@@ -1394,8 +2769,34 @@ void vmsbackup(void)
 			}
 		}
 		else if (i == -1) {
-			perror ("error reading saveset");
-			exit (EXIT_FAILURE);
+			/* A block that can be rebuilt from its group is
+			   reported when it is rebuilt, or found lost.  */
+			if (!group_unread()) {
+				perror ("error reading saveset");
+				if (salvage && !ondisk
+				    && ++errors < SALVAGE_TRIES) {
+					fprintf(stderr, "Block after %lu lost\n",
+						salv_number);
+					salvage_cut();
+				} else {
+					group_end();
+#ifdef HAVE_PTHREAD
+					batch_flush();
+#endif
+					exit (EXIT_FAILURE);
+				}
+			}
+		}
+		else if (i != blocksize && salvage && ondisk) {
+			fprintf(stderr, "Saveset ends with %d bytes, not a whole block\n",
+				i);
+			salv_damage++;
+			eoffl = 1;
+		}
+		else if (i != blocksize && salvage) {
+			fprintf(stderr, "Block after %lu is %d bytes long, skipped\n",
+				salv_number, i);
+			salvage_cut();
 		}
 		else if (i != blocksize) {
 			fprintf(stderr, "bad block read i = %d\n", i);
@@ -1403,7 +2804,11 @@ void vmsbackup(void)
 		}
 		else {
 			eoffl = 0;
-			process_block(block, i);
+			errors = 0;
+			if (salvage)
+				salvage_block(block, i);
+			else
+				group_block(block, i);
 		}
 	}
 	if(vflag || tflag) {
@@ -1416,8 +2821,20 @@ void vmsbackup(void)
 		}
 	}
 
+	if (!ondisk)
+		toc_save();
+
 	/* close the tape */
-	close(fd);
+	tape_close();
+
+	if (crc_errors > 0)
+		fprintf(stderr, "%lu blocks failed the CRC or checksum\n",
+			crc_errors);
+	if (salv_damage > 0)
+		fprintf(stderr, "%lu damaged blocks were skipped or cut short\n",
+			salv_damage);
+	if (crc_errors > 0 || salv_damage > 0)
+		exit(EXIT_FAILURE);
 
 #ifdef	NEWD
 	/* close debug file */
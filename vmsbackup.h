@@ -7,6 +7,17 @@ extern int flag_full;
 extern char *tapefile;
 extern int selset;
 extern int blocksize;
+extern long tape_buffer;
+extern int flag_buffer_lock, flag_buffer_huge;
+extern int uring_depth;
+extern int nthreads;
+extern char *image_file;
+extern int to_utf8;
+extern int verify_crc;
+extern int salvage;
+extern long write_buffer;
+extern int sparse;
+extern int uring_files;
 
 extern void vmsbackup (void);
 
@@ -0,0 +1,301 @@
+/*
+ *  Scanning and translating the data of text files.  Stream_LF files
+ *  are copied as they are, but we need to know where the last line in a
+ *  block ends; Stream_CR files have every carriage return turned into a
+ *  newline.  With --to-utf8 the text is also converted from the DEC
+ *  Multinational Character Set or Latin-1 to UTF-8.  All of this is done
+ *  over a whole VBN record or run of record text at a time.
+ *
+ *  With HAVE_X86_SIMD, and a compiler that knows about target
+ *  attributes (gcc or clang), there are SSE2 and AVX2 versions; which
+ *  one is used is decided on the first call from what the CPU can do.
+ *  Otherwise, and for what is left over at the ends, it is done a byte
+ *  at a time.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "xlate.h"
+
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define XLATE_X86
+#include <immintrin.h>
+#endif
+
+static void crlf_scalar (unsigned char *dst, const unsigned char *src,
+			 size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = src[i] == '\r' ? '\n' : src[i];
+}
+
+static const unsigned char *last_scalar (const unsigned char *p, size_t n,
+					 int c)
+{
+	while (n > 0)
+		if (p[--n] == c)
+			return p + n;
+	return NULL;
+}
+
+/* How many of the N bytes at P are ASCII before the first that is not.  */
+static size_t ascii_scalar (const unsigned char *p, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && p[i] < 0x80; i++)
+		;
+	return i;
+}
+
+#ifdef XLATE_X86
+
+/* '\r' ^ '\n': flipping these bits turns a carriage return into a
+   newline.  */
+#define CRLF_FLIP	('\r' ^ '\n')
+
+__attribute__((target("sse2")))
+static void crlf_sse2 (unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	__m128i cr = _mm_set1_epi8 ('\r'), flip = _mm_set1_epi8 (CRLF_FLIP);
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(src + i));
+		v = _mm_xor_si128 (v, _mm_and_si128 (_mm_cmpeq_epi8 (v, cr),
+						     flip));
+		_mm_storeu_si128 ((__m128i *)(dst + i), v);
+	}
+	crlf_scalar (dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void crlf_avx2 (unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	__m256i cr = _mm256_set1_epi8 ('\r');
+	__m256i flip = _mm256_set1_epi8 (CRLF_FLIP);
+	__m256i v;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256 ((const __m256i *)(src + i));
+		v = _mm256_xor_si256 (v, _mm256_and_si256 (
+					      _mm256_cmpeq_epi8 (v, cr), flip));
+		_mm256_storeu_si256 ((__m256i *)(dst + i), v);
+	}
+	crlf_scalar (dst + i, src + i, n - i);
+}
+
+/* Both go backwards from the end, a vector at a time, and finish off
+   the odd bytes at the start with last_scalar.  */
+__attribute__((target("sse2")))
+static const unsigned char *last_sse2 (const unsigned char *p, size_t n,
+				       int c)
+{
+	__m128i want = _mm_set1_epi8 (c);
+	unsigned mask;
+
+	while (n >= 16) {
+		n -= 16;
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+			_mm_loadu_si128 ((const __m128i *)(p + n)), want));
+		if (mask != 0)
+			return p + n + 31 - __builtin_clz (mask);
+	}
+	return last_scalar (p, n, c);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *last_avx2 (const unsigned char *p, size_t n,
+				       int c)
+{
+	__m256i want = _mm256_set1_epi8 (c);
+	unsigned mask;
+
+	while (n >= 32) {
+		n -= 32;
+		mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+			_mm256_loadu_si256 ((const __m256i *)(p + n)), want));
+		if (mask != 0)
+			return p + n + 31 - __builtin_clz (mask);
+	}
+	return last_scalar (p, n, c);
+}
+
+/* The top bit of each byte is all movemask looks at.  */
+__attribute__((target("sse2")))
+static size_t ascii_sse2 (const unsigned char *p, size_t n)
+{
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8 (_mm_loadu_si128 (
+			(const __m128i *)(p + i)));
+		if (mask != 0)
+			return i + __builtin_ctz (mask);
+	}
+	return i + ascii_scalar (p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_avx2 (const unsigned char *p, size_t n)
+{
+	unsigned mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		mask = _mm256_movemask_epi8 (_mm256_loadu_si256 (
+			(const __m256i *)(p + i)));
+		if (mask != 0)
+			return i + __builtin_ctz (mask);
+	}
+	return i + ascii_scalar (p + i, n - i);
+}
+
+#endif /* XLATE_X86 */
+
+static void crlf_pick (unsigned char *, const unsigned char *, size_t);
+static const unsigned char *last_pick (const unsigned char *, size_t, int);
+static size_t ascii_pick (const unsigned char *, size_t);
+
+static void (*crlf_fn) (unsigned char *, const unsigned char *, size_t)
+	= crlf_pick;
+static const unsigned char *(*last_fn) (const unsigned char *, size_t, int)
+	= last_pick;
+static size_t (*ascii_fn) (const unsigned char *, size_t) = ascii_pick;
+
+/* Choose the kernels for this CPU.  */
+static void xlate_pick (void)
+{
+	crlf_fn = crlf_scalar;
+	last_fn = last_scalar;
+	ascii_fn = ascii_scalar;
+#ifdef XLATE_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2")) {
+		crlf_fn = crlf_avx2;
+		last_fn = last_avx2;
+		ascii_fn = ascii_avx2;
+	} else if (__builtin_cpu_supports ("sse2")) {
+		crlf_fn = crlf_sse2;
+		last_fn = last_sse2;
+		ascii_fn = ascii_sse2;
+	}
+#endif
+}
+
+static void crlf_pick (unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	xlate_pick ();
+	crlf_fn (dst, src, n);
+}
+
+static const unsigned char *last_pick (const unsigned char *p, size_t n,
+				       int c)
+{
+	xlate_pick ();
+	return last_fn (p, n, c);
+}
+
+static size_t ascii_pick (const unsigned char *p, size_t n)
+{
+	xlate_pick ();
+	return ascii_fn (p, n);
+}
+
+/* Copy N bytes from SRC to DST, turning carriage returns into
+   newlines.  */
+void xlate_crlf (unsigned char *dst, const unsigned char *src, size_t n)
+{
+	crlf_fn (dst, src, n);
+}
+
+/* The last C in the N bytes at P, or NULL if there is none.  */
+const unsigned char *xlate_last (const unsigned char *p, size_t n, int c)
+{
+	return last_fn (p, n, c);
+}
+
+/* How many of the N bytes at P are ASCII before the first that is not.  */
+size_t xlate_ascii (const unsigned char *p, size_t n)
+{
+	return ascii_fn (p, n);
+}
+
+/* Where the DEC Multinational Character Set differs from Latin-1.  The
+   positions MCS leaves reserved are taken as Latin-1.  */
+#define MCS_DIFFS	5
+static const struct {
+	unsigned char c;
+	unsigned short u;
+} mcs_diff[MCS_DIFFS] = {
+	{ 0xa8, 0x00a4 },	/* currency sign */
+	{ 0xd7, 0x0152 },	/* OE ligature */
+	{ 0xdd, 0x0178 },	/* Y diaeresis */
+	{ 0xf7, 0x0153 },	/* oe ligature */
+	{ 0xfd, 0x00ff },	/* y diaeresis */
+};
+
+/* The UTF-8 for each byte from 0x80 up, which is always two bytes.  */
+static unsigned char utf8_tab[2][128][2];
+
+static void utf8_init (void)
+{
+	unsigned u;
+	int cs, c, i;
+
+	for (cs = 0; cs < 2; cs++)
+		for (c = 0x80; c < 0x100; c++) {
+			u = c;
+			if (cs == XLATE_MCS - 1)
+				for (i = 0; i < MCS_DIFFS; i++)
+					if (mcs_diff[i].c == c)
+						u = mcs_diff[i].u;
+			utf8_tab[cs][c - 0x80][0] = 0xc0 | (u >> 6);
+			utf8_tab[cs][c - 0x80][1] = 0x80 | (u & 0x3f);
+		}
+}
+
+/* Set everything up now rather than on first use, for when the
+   functions above are going to be called from several threads.  */
+void xlate_init (void)
+{
+	xlate_pick ();
+	if (utf8_tab[0][0][0] == 0)
+		utf8_init ();
+}
+
+/* Convert N bytes at SRC in the character set CHARSET (XLATE_MCS or
+   XLATE_LATIN1) to UTF-8 at DST, which must have room for 2 * N bytes.
+   Returns the length of the result.  */
+size_t xlate_utf8 (unsigned char *dst, const unsigned char *src, size_t n,
+		   int charset)
+{
+	unsigned char (*tab)[2];
+	size_t i, o, k;
+
+	if (utf8_tab[0][0][0] == 0)
+		utf8_init ();
+	tab = utf8_tab[charset - 1];
+	i = o = 0;
+	while (i < n) {
+		k = ascii_fn (src + i, n - i);
+		memcpy (dst + o, src + i, k);
+		i += k;
+		o += k;
+		for (; i < n && src[i] >= 0x80; i++) {
+			dst[o++] = tab[src[i] - 0x80][0];
+			dst[o++] = tab[src[i] - 0x80][1];
+		}
+	}
+	return o;
+}
@@ -0,0 +1,12 @@
+/* Text file scanning and translation, see xlate.c.  */
+
+/* Character sets for xlate_utf8.  */
+#define XLATE_MCS	1
+#define XLATE_LATIN1	2
+
+void xlate_init (void);
+void xlate_crlf (unsigned char *dst, const unsigned char *src, size_t n);
+const unsigned char *xlate_last (const unsigned char *p, size_t n, int c);
+size_t xlate_ascii (const unsigned char *p, size_t n);
+size_t xlate_utf8 (unsigned char *dst, const unsigned char *src, size_t n,
+		   int charset);